@@ -2,7 +2,8 @@
 
 set CC=gcc
 set CFLAGS=-std=c17 -Wall -Wextra -Wpedantic -O2 -s
-set SOURCE=write_gpt.c
+set SOURCE=write_gpt.c gptimage.c crc32.c
 set TARGET=write_gpt
+set LDLIBS=-pthread -lz
 
-%CC% %CFLAGS% %SOURCE% -o %TARGET%
+%CC% %CFLAGS% %SOURCE% -o %TARGET% %LDLIBS%
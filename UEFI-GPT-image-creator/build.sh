@@ -4,8 +4,9 @@ set -eu
 
 CC="cc"
 CFLAGS="-std=c17 -Wall -Wextra -Wpedantic -O2 -s"
-SOURCE="write_gpt.c"
+SOURCE="write_gpt.c gptimage.c crc32.c"
 TARGET="write_gpt"
+LDLIBS="-pthread -lz"
 
-$CC $CFLAGS $SOURCE -o $TARGET
+$CC $CFLAGS $SOURCE -o $TARGET $LDLIBS
 
@@ -0,0 +1,226 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "crc32.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32_HAVE_PCLMUL 1
+#include <immintrin.h>
+#endif
+
+// -------------------------------------
+// Global Variables
+// -------------------------------------
+// Slice-by-16 tables; crc_table[0] is the classic byte-at-a-time table,
+//   crc_table[k] advances a byte through k more zero bytes
+static uint32_t crc_table[16][256];
+
+// Selected implementation, set at startup by crc32_init()
+static uint32_t (*crc32_impl)(uint32_t, const void *, size_t) = crc32_update_slice16;
+static const char *crc32_impl_str = "slice16";
+
+// =====================================
+// Slice-by-16 CRC32, 16 bytes per step
+// =====================================
+uint32_t crc32_update_slice16(uint32_t crc, const void *buf, size_t len) {
+    const uint8_t *bufp = buf;
+    uint32_t c = ~crc;
+
+    while (len >= 16) {
+        uint32_t w[4];
+        memcpy(w, bufp, sizeof w);  // Little endian loads
+        w[0] ^= c;
+
+        c = crc_table[15][ w[0]        & 0xFF] ^ crc_table[14][(w[0] >>  8) & 0xFF] ^
+            crc_table[13][(w[0] >> 16) & 0xFF] ^ crc_table[12][ w[0] >> 24        ] ^
+            crc_table[11][ w[1]        & 0xFF] ^ crc_table[10][(w[1] >>  8) & 0xFF] ^
+            crc_table[ 9][(w[1] >> 16) & 0xFF] ^ crc_table[ 8][ w[1] >> 24        ] ^
+            crc_table[ 7][ w[2]        & 0xFF] ^ crc_table[ 6][(w[2] >>  8) & 0xFF] ^
+            crc_table[ 5][(w[2] >> 16) & 0xFF] ^ crc_table[ 4][ w[2] >> 24        ] ^
+            crc_table[ 3][ w[3]        & 0xFF] ^ crc_table[ 2][(w[3] >>  8) & 0xFF] ^
+            crc_table[ 1][(w[3] >> 16) & 0xFF] ^ crc_table[ 0][ w[3] >> 24        ];
+
+        bufp += 16;
+        len -= 16;
+    }
+
+    // Remaining bytes, 1 at a time
+    while (len--)
+        c = crc_table[0][(c ^ *bufp++) & 0xFF] ^ (c >> 8);
+
+    return ~c;
+}
+
+#ifdef CRC32_HAVE_PCLMUL
+// =====================================
+// Fold 16 byte blocks with carry-less multiplies, then Barrett reduce to 32 bits;
+//   from Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ".
+//   Input & output are the raw (non-inverted) CRC state, len must be a
+//   multiple of 16 and at least 64
+// =====================================
+__attribute__ ((target("pclmul,sse4.1")))
+static uint32_t crc32_fold_pclmul(uint32_t crc, const uint8_t *buf, size_t len) {
+    // Bit-reflected fold-by-4, fold-by-1, 64 bit fold and Barrett reduction
+    //   constants for the CRC32 polynomial (values from the paper above)
+    _Alignas(16) static const uint64_t k1k2[2] = { 0x0154442bd4, 0x01c6e41596 };
+    _Alignas(16) static const uint64_t k3k4[2] = { 0x01751997d0, 0x00ccaa009e };
+    _Alignas(16) static const uint64_t k5k0[2] = { 0x0163cd6124, 0x0000000000 };
+    _Alignas(16) static const uint64_t poly[2] = { 0x01db710641, 0x01f7011641 };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    len -= 64;
+
+    // Fold 4 x 128 bits in parallel while 64+ bytes remain
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        buf += 64;
+        len -= 64;
+    }
+
+    // Fold 4 x 128 bits into 128 bits
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Fold any remaining 16 byte blocks
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        buf += 16;
+        len -= 16;
+    }
+
+    // Fold 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduce to 32 bits
+    x0 = _mm_load_si128((const __m128i *)poly);
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+// =====================================
+// PCLMULQDQ CRC32; folds the bulk of the buffer, slice-by-16 for the tail
+// =====================================
+static uint32_t crc32_update_pclmul(uint32_t crc, const void *buf, size_t len) {
+    const uint8_t *bufp = buf;
+
+    if (len >= 64) {
+        const size_t bulk_len = len & ~(size_t)15;
+        crc = ~crc32_fold_pclmul(~crc, bufp, bulk_len);
+        bufp += bulk_len;
+        len -= bulk_len;
+    }
+
+    return crc32_update_slice16(crc, bufp, len);
+}
+#endif // CRC32_HAVE_PCLMUL
+
+// =====================================
+// Create CRC32 table values & select implementation; ran once at startup
+// =====================================
+__attribute__ ((constructor))
+static void crc32_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (uint8_t k = 0; k < 8; k++) {
+            if (c & 1)
+                c = 0xedb88320L ^ (c >> 1);
+            else
+                c = c >> 1;
+        }
+        crc_table[0][n] = c;
+    }
+
+    for (uint32_t n = 0; n < 256; n++) {
+        for (uint8_t k = 1; k < 16; k++)
+            crc_table[k][n] = (crc_table[k-1][n] >> 8) ^ crc_table[0][crc_table[k-1][n] & 0xFF];
+    }
+
+#ifdef CRC32_HAVE_PCLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        crc32_impl = crc32_update_pclmul;
+        crc32_impl_str = "pclmul";
+    }
+#endif
+}
+
+// =====================================
+// Continue CRC32 over more data, using selected implementation
+// =====================================
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len) {
+    return crc32_impl(crc, buf, len);
+}
+
+// =====================================
+// Calculate CRC32 value for range of data
+// =====================================
+uint32_t calculate_crc32(const void *buf, size_t len) {
+    return crc32_impl(0, buf, len);
+}
+
+// =====================================
+// Get name of selected implementation
+// =====================================
+const char *crc32_impl_name(void) {
+    return crc32_impl_str;
+}
@@ -0,0 +1,28 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// -------------------------------------
+// CRC32 (IEEE 802.3 polynomial, as used for GPT headers/tables)
+//
+// The fastest implementation for the running CPU is picked once at program
+//   startup: a PCLMULQDQ folding kernel on x86-64 CPUs that support it,
+//   otherwise slice-by-16 table lookups.
+// -------------------------------------
+
+// Continue a CRC32 over the next part of a buffer/stream; start with crc = 0
+//   e.g. crc = crc32_update(0, a, len_a); crc = crc32_update(crc, b, len_b);
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+
+// Calculate CRC32 value for range of data
+uint32_t calculate_crc32(const void *buf, size_t len);
+
+// Portable slice-by-16 implementation, always available
+uint32_t crc32_update_slice16(uint32_t crc, const void *buf, size_t len);
+
+// Name of implementation used by crc32_update(), e.g. "pclmul" or "slice16"
+const char *crc32_impl_name(void);
+
+#endif // CRC32_H
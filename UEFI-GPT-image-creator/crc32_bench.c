@@ -0,0 +1,109 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "crc32.h"
+
+// -------------------------------------
+// CRC32 microbenchmark; compares the original byte-at-a-time table loop
+//   against slice-by-16 and the runtime selected implementation.
+//
+// usage: crc32_bench [buffer size MiB] [iterations]
+// -------------------------------------
+
+// =====================================
+// Original byte at a time CRC32, for reference
+// =====================================
+uint32_t ref_table[256];
+
+void ref_create_table(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (uint8_t k = 0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320L ^ (c >> 1) : c >> 1;
+        ref_table[n] = c;
+    }
+}
+
+uint32_t ref_update(uint32_t crc, const void *buf, size_t len) {
+    const uint8_t *bufp = buf;
+    uint32_t c = ~crc;
+    for (size_t n = 0; n < len; n++)
+        c = ref_table[(c ^ bufp[n]) & 0xFF] ^ (c >> 8);
+    return ~c;
+}
+
+// =====================================
+// Get monotonic time in seconds
+// =====================================
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// =====================================
+// Time one implementation over the buffer, print MiB/s
+// =====================================
+uint32_t bench(const char *name,
+               uint32_t (*fn)(uint32_t, const void *, size_t),
+               const uint8_t *buf, size_t size, uint32_t iterations) {
+    uint32_t crc = 0;
+    const double start = now();
+    for (uint32_t i = 0; i < iterations; i++)
+        crc = fn(0, buf, size);
+    const double secs = now() - start;
+
+    printf("%-10s %10.1f MiB/s  crc=%08"PRIx32"\n",
+           name,
+           (double)size * iterations / (1024.0 * 1024.0) / secs,
+           crc);
+    return crc;
+}
+
+// =============================
+// MAIN
+// =============================
+int main(int argc, char *argv[]) {
+    const size_t size = (argc > 1 ? strtoull(argv[1], NULL, 10) : 64) * 1024 * 1024;
+    const uint32_t iterations = argc > 2 ? strtoul(argv[2], NULL, 10) : 4;
+
+    uint8_t *buf = malloc(size);
+    if (!buf || !size || !iterations) {
+        fprintf(stderr, "usage: %s [buffer size MiB] [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    srand(time(NULL));
+    for (size_t i = 0; i < size; i++) buf[i] = rand() & 0xFF;
+
+    ref_create_table();
+
+    // Check streaming in odd sized pieces matches single buffer results
+    uint32_t streamed = 0;
+    for (size_t offset = 0, len = 1; offset < size; offset += len, len = len * 3 + 1) {
+        if (len > size - offset) len = size - offset;
+        streamed = crc32_update(streamed, buf + offset, len);
+    }
+
+    printf("buffer: %zu MiB x %"PRIu32", selected: %s\n",
+           size / (1024 * 1024), iterations, crc32_impl_name());
+
+    const uint32_t ref = bench("bytewise", ref_update, buf, size, iterations);
+    bool ok = bench("slice16", crc32_update_slice16, buf, size, iterations) == ref;
+    ok &= bench("selected", crc32_update, buf, size, iterations) == ref;
+    ok &= streamed == ref;
+
+    free(buf);
+    if (!ok) {
+        fprintf(stderr, "Error: CRC32 mismatch between implementations\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
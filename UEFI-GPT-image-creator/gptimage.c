@@ -0,0 +1,4253 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64   // 64 bit off_t for multi-GB images on 32 bit systems
+#define _CRT_RAND_S            // rand_s() on Windows
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <uchar.h> 
+#include <string.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <winioctl.h>
+#include <io.h>
+#define strtok_r strtok_s
+#define localtime_r(timep, result) (localtime_s((result), (timep)) == 0 ? (result) : NULL)
+#else
+#include <sys/mman.h>
+#include <sys/random.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0      // Only Windows has text mode file descriptors
+#endif
+
+#include "crc32.h"
+#include "gptimage.h"
+
+// -------------------------------------
+// Global Typedefs
+// -------------------------------------
+// Globally Unique IDentifier (aka UUID) 
+typedef struct {
+    uint32_t time_lo;
+    uint16_t time_mid;
+    uint16_t time_hi_and_ver;       // Highest 4 bits are version #
+    uint8_t clock_seq_hi_and_res;   // Highest bits are variant #
+    uint8_t clock_seq_lo;
+    uint8_t node[6];
+} __attribute__ ((packed)) Guid;
+
+// MBR Partition
+typedef struct {
+    uint8_t boot_indicator;
+    uint8_t starting_chs[3];
+    uint8_t os_type;
+    uint8_t ending_chs[3];
+    uint32_t starting_lba;
+    uint32_t size_lba;
+} __attribute__ ((packed)) Mbr_Partition;
+
+// Master Boot Record
+typedef struct {
+    uint8_t boot_code[440];
+    uint32_t mbr_signature;
+    uint16_t unknown;
+    Mbr_Partition partition[4];
+    uint16_t boot_signature;
+} __attribute__ ((packed)) Mbr;
+
+// GPT Header
+typedef struct {
+    uint8_t signature[8];
+    uint32_t revision;
+    uint32_t header_size;
+    uint32_t header_crc32;
+    uint32_t reserved_1;
+    uint64_t my_lba;
+    uint64_t alternate_lba;
+    uint64_t first_usable_lba;
+    uint64_t last_usable_lba;
+    Guid disk_guid;
+    uint64_t partition_table_lba;
+    uint32_t number_of_entries;
+    uint32_t size_of_entry;
+    uint32_t partition_table_crc32;
+
+    uint8_t reserved_2[512-92];
+} __attribute__ ((packed)) Gpt_Header;
+
+// GPT Partition Entry
+typedef struct {
+    Guid partition_type_guid;
+    Guid unique_guid;
+    uint64_t starting_lba;
+    uint64_t ending_lba;
+    uint64_t attributes;
+    char16_t name[36];  // UCS-2 (UTF-16 limited to code points 0x0000 - 0xFFFF)
+} __attribute__ ((packed)) Gpt_Partition_Entry;
+
+// FAT32 Volume Boot Record (VBR)
+typedef struct {
+    uint8_t  BS_jmpBoot[3];
+    uint8_t  BS_OEMName[8];
+    uint16_t BPB_BytesPerSec;
+    uint8_t  BPB_SecPerClus;
+    uint16_t BPB_RsvdSecCnt;
+    uint8_t  BPB_NumFATs;
+    uint16_t BPB_RootEntCnt;
+    uint16_t BPB_TotSec16;
+    uint8_t  BPB_Media;
+    uint16_t BPB_FATSz16;
+    uint16_t BPB_SecPerTrk;
+    uint16_t BPB_NumHeads;
+    uint32_t BPB_HiddSec;
+    uint32_t BPB_TotSec32;
+    uint32_t BPB_FATSz32;
+    uint16_t BPB_ExtFlags;
+    uint16_t BPB_FSVer;
+    uint32_t BPB_RootClus;
+    uint16_t BPB_FSInfo;
+    uint16_t BPB_BkBootSec;
+    uint8_t  BPB_Reserved[12];
+    uint8_t  BS_DrvNum;
+    uint8_t  BS_Reserved1;
+    uint8_t  BS_BootSig;
+    uint8_t  BS_VolID[4];
+    uint8_t  BS_VolLab[11];
+    uint8_t  BS_FilSysType[8];
+
+    // Not in fatgen103.doc tables
+    uint8_t  boot_code[510-90];
+    uint16_t bootsect_sig;      // 0xAA55
+} __attribute__ ((packed)) Vbr;
+
+// FAT32 File System Info Sector
+typedef struct {
+    uint32_t FSI_LeadSig;
+    uint8_t  FSI_Reserved1[480];
+    uint32_t FSI_StrucSig;
+    uint32_t FSI_Free_Count;
+    uint32_t FSI_Nxt_Free;
+    uint8_t  FSI_Reserved2[12];
+    uint32_t FSI_TrailSig;
+} __attribute__ ((packed)) FSInfo;
+
+// FAT32 Directory Entry (Short Name)
+typedef struct {
+    uint8_t  DIR_Name[11];
+    uint8_t  DIR_Attr;
+    uint8_t  DIR_NTRes;
+    uint8_t  DIR_CrtTimeTenth;
+    uint16_t DIR_CrtTime;
+    uint16_t DIR_CrtDate;
+    uint16_t DIR_LstAccDate;
+    uint16_t DIR_FstClusHI;
+    uint16_t DIR_WrtTime;
+    uint16_t DIR_WrtDate;
+    uint16_t DIR_FstClusLO;
+    uint32_t DIR_FileSize;
+} __attribute__ ((packed)) FAT32_Dir_Entry_Short;
+
+// FAT32 Directory Entry Attributes
+typedef enum {
+    ATTR_READ_ONLY = 0x01,
+    ATTR_HIDDEN    = 0x02,
+    ATTR_SYSTEM    = 0x04,
+    ATTR_VOLUME_ID = 0x08,
+    ATTR_DIRECTORY = 0x10,
+    ATTR_ARCHIVE   = 0x20,
+    ATTR_LONG_NAME = ATTR_READ_ONLY | ATTR_HIDDEN |
+                     ATTR_SYSTEM    | ATTR_VOLUME_ID,
+} FAT32_Dir_Attr;
+
+
+// FAT32 File "types"
+typedef enum {
+    TYPE_DIR,   // Directory
+    TYPE_FILE,  // Regular file
+} File_Type;
+
+// In-memory index of an ESP directory's entries, by 8.3 name
+typedef struct Esp_Dir Esp_Dir;
+
+typedef struct Esp_Node {
+    uint8_t name[11];           // 8.3 name, as in DIR_Name
+    uint32_t cluster;           // First cluster of file/dir data
+    uint32_t entry;             // Index of this dir entry in parent directory
+    Esp_Dir *dir;               // Sub directory index, NULL for files
+    struct Esp_Node *next;      // Next node in same hash bucket
+} Esp_Node;
+
+struct Esp_Dir {
+    uint32_t cluster;           // First cluster of this directory's dir entries
+    uint32_t last_cluster;      // Last cluster in directory's cluster chain
+    uint32_t next_entry;        // Index of next free dir entry in this directory
+    uint32_t num_nodes;
+    uint32_t num_buckets;       // Power of 2
+    Esp_Node **buckets;
+};
+
+// Common Virtual Hard Disk Footer, for a "fixed" vhd
+// All fields are in network byte order (Big Endian),
+//   since I'm lazy or otherwise a bad programmer,
+//   we'll use byte arrays here
+typedef struct {
+    uint8_t cookie[8];
+    uint8_t features[4];
+    uint8_t version[4];
+    uint64_t data_offset;
+    uint8_t timestamp[4];
+    uint8_t creator_app[4];
+    uint8_t creator_ver[4];
+    uint8_t creator_OS[4];
+    uint8_t original_size[8];
+    uint8_t current_size[8];
+    uint8_t disk_geometry[4];
+    uint8_t disk_type[4];
+    uint8_t checksum[4];
+    Guid unique_id;
+    uint8_t saved_state;
+    uint8_t reserved[427];
+} __attribute__ ((packed)) Vhd;
+
+// Dynamic Virtual Hard Disk Header, after the copy of the footer at the start of a
+//   "dynamic" vhd; also Big Endian byte arrays
+typedef struct {
+    uint8_t cookie[8];
+    uint8_t data_offset[8];
+    uint8_t table_offset[8];
+    uint8_t header_version[4];
+    uint8_t max_table_entries[4];
+    uint8_t block_size[4];
+    uint8_t checksum[4];
+    Guid parent_unique_id;
+    uint8_t parent_timestamp[4];
+    uint8_t reserved_1[4];
+    uint8_t parent_unicode_name[512];
+    uint8_t parent_locator_entries[8][24];
+    uint8_t reserved_2[256];
+} __attribute__ ((packed)) Vhd_Dynamic_Header;
+
+// QEMU Copy-On-Write v3 image header; all fields are Big Endian
+typedef struct {
+    uint8_t magic[4];
+    uint8_t version[4];
+    uint8_t backing_file_offset[8];
+    uint8_t backing_file_size[4];
+    uint8_t cluster_bits[4];
+    uint8_t size[8];
+    uint8_t crypt_method[4];
+    uint8_t l1_size[4];
+    uint8_t l1_table_offset[8];
+    uint8_t refcount_table_offset[8];
+    uint8_t refcount_table_clusters[4];
+    uint8_t nb_snapshots[4];
+    uint8_t snapshots_offset[8];
+    uint8_t incompatible_features[8];
+    uint8_t compatible_features[8];
+    uint8_t autoclear_features[8];
+    uint8_t refcount_order[4];
+    uint8_t header_length[4];
+    uint8_t end_extension[8];   // Header extension end marker; type & length 0
+} __attribute__ ((packed)) Qcow2_Header;
+
+// Planned copy of a local file's data into the image; payloads are copied after
+//   all of their clusters/lbas are decided, by a pool of worker threads
+typedef struct {
+    char *filepath;     // Local file to copy from
+    uint64_t lba;       // Image lba to copy to
+    uint64_t size;      // Planned size of file data in bytes
+    uint32_t crc32;     // CRC32 of file data, for data partition files
+    bool has_crc32;     // False if the kernel copied the data without it being read
+    int64_t data_file;  // Index in data_files[] for data partition files, else -1
+    bool error;
+} Copy_Job;
+
+// Chunk of the image to compress into its own gzip member, by a pool of worker threads
+typedef struct {
+    const uint8_t *data;
+    uint64_t size;
+    uint8_t *out;       // gzip member; NULL if chunk is all 0s
+    uint64_t out_size;
+    bool error;
+} Gzip_Chunk;
+
+// Batch of gzip chunks shared by worker threads
+typedef struct {
+    const Gpt_Image *image;
+    Gzip_Chunk *chunks;
+    uint32_t num_chunks;
+    atomic_uint next_chunk;     // Next chunk for a worker thread to take
+} Gzip_Batch;
+
+// Data partition file, as listed in DATAFLS.INF
+typedef struct {
+    char *name;         // File name without folders; NULL if file could not be copied
+    uint64_t size;
+    uint32_t crc32;
+    bool has_crc32;     // False if DATAFLS.INF listed no FILE_CRC32; only extents are checked
+    uint64_t lba;
+} Data_File;
+
+// Extra GPT partition after the ESP & Basic Data Partition, from a -p layout spec
+typedef struct {
+    Guid type_guid;
+    char name[37];      // ASCII, up to 36 chars
+    uint64_t size;      // Bytes
+    uint64_t align;     // Start alignment in bytes, from start of disk
+    char *spec;         // Private copy of the layout spec, which filepath points into
+    char *filepath;     // Local file or stream of raw contents; NULL = left as 0s
+    FILE *stream;       // Open stream from open_input(), or NULL for a regular file
+    uint64_t file_size; // Size of raw contents, UINT64_MAX if stream size is unknown
+    uint64_t lba;       // Starting lba
+    uint64_t size_lbas;
+} Partition;
+
+// Disk image being built or updated, mapped into memory in full; all on-disk structures
+//   are built by writing directly into the mapping. Holds all state for 1 image, so
+//   separate images can be built at the same time
+struct Gpt_Image {
+    int fd;
+    uint8_t *data;
+#ifdef _WIN32
+    HANDLE mapping;     // File mapping object data is a view of
+#endif
+    uint64_t size;      // Size of image file in bytes, including any vhd footer
+    uint64_t block_size;    // Filesystem block size of image file, for reflinking file data
+    char *name;         // Image file name, as given
+    Gpt_Image_Config config;
+
+    uint64_t lba_size;
+    uint64_t esp_size;
+    uint64_t data_size;
+    uint64_t image_size;
+    uint64_t cluster_size;          // FAT32 cluster size in bytes
+    uint64_t esp_size_lbas, data_size_lbas, image_size_lbas, 
+             gpt_table_lbas;                              // Sizes in lbas
+    uint64_t align_lba, esp_lba, data_lba,
+             fat32_fats_lba, fat32_data_lba;              // Starting LBA values
+
+    // In-memory FAT for the ESP; tracks all cluster chains while files are added,
+    //   and is written to each FAT copy in the image once, in finalize_esp()
+    uint32_t *fat32_fat;
+    uint64_t fat32_lbas_per_cluster;
+    uint32_t fat32_num_clusters;    // # of FAT entries in use-able range, incl. reserved clusters 0 & 1
+    uint32_t fat32_next_free;       // Next free cluster to allocate from
+    uint32_t fat32_free_clusters;   // # of free clusters, for FSInfo free count
+    uint64_t esp_align;             // ESP file data starts on a multiple of this many bytes from start of disk
+
+    // In-memory ESP directory tree, for looking up paths while adding files
+    Esp_Dir *esp_root_dir;
+
+    // Planned file copies for the current batch, and # of threads to copy them with
+    Copy_Job *copy_jobs;
+    uint32_t num_copy_jobs;
+    atomic_uint next_copy_job;      // Next job for a worker thread to take
+    uint32_t num_copy_threads;
+    bool copy_failed;               // Sticky; a file in any batch could not be copied
+
+    // Data partition files added, and next free lba after them (from start of data partition)
+    Data_File *data_files;
+    uint64_t num_data_files;
+    uint64_t data_next_lba;
+
+    // Extra partitions after the Basic Data Partition, in GPT table order
+    Partition *partitions;
+    uint32_t num_partitions;
+
+    // Update files in an existing image, instead of creating a new image
+    bool update_image;
+};
+
+// -------------------------------------
+// Global constants, enums
+// -------------------------------------
+// EFI System Partition GUID
+static const Guid ESP_GUID = { 0xC12A7328, 0xF81F, 0x11D2, 0xBA, 0x4B, 
+                        { 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B } };
+
+// (Microsoft) Basic Data GUID
+static const Guid BASIC_DATA_GUID = { 0xEBD0A0A2, 0xB9E5, 0x4433, 0x87, 0xC0,
+                                { 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7 } };
+
+enum {
+    GPT_TABLE_ENTRY_SIZE = 128,
+    NUMBER_OF_GPT_TABLE_ENTRIES = 128,
+    GPT_TABLE_SIZE = 16384,             // Minimum size per UEFI spec 2.10
+    ALIGNMENT = 1048576,                // 1 MiB alignment value
+    FAT32_MIN_CLUSTERS = 65525,         // Less clusters than this is FAT12/16 per fatgen103.doc
+    FAT32_MAX_CLUSTERS = 268435445,     // Most clusters with 28 bit FAT entries, 0x0FFFFFF5
+    FAT32_MAX_CLUSTER_SIZE = 32768,     // Largest cluster size in bytes
+    FAT32_MAX_DIR_ENTRIES = 65536,      // Most dir entries a directory can have
+    FAT32_RESERVED_SECTORS = 32,        // Reserved region before the FATs, incl. VBR & FSInfo
+    FAT32_NUM_FATS = 2,
+    MAX_COPY_JOBS = 4096,               // Most planned file copies before copying a batch
+    VHD_BLOCK_SIZE = 2097152,           // Dynamic vhd block size, 2 MiB default per VHD spec
+    QCOW2_CLUSTER_BITS = 16,            // qcow2 cluster size 64 KiB, same as qemu-img default
+    QCOW2_CLUSTER_SIZE = 1 << QCOW2_CLUSTER_BITS,
+    GZIP_CHUNK_SIZE = 4194304,          // Image data per gzip member, 4 MiB
+    SMALL_FILE_SIZE = 65536,            // Files up to this size are read straight into the image
+};
+
+// =====================================
+// Convert bytes to LBAs
+// =====================================
+static uint64_t bytes_to_lbas(const Gpt_Image *image, const uint64_t bytes) {
+    return (bytes + (image->lba_size - 1)) / image->lba_size;
+}
+
+// =====================================
+// Convert bytes to FAT32 clusters
+// =====================================
+static uint64_t bytes_to_clusters(const Gpt_Image *image, const uint64_t bytes) {
+    return (bytes + (image->cluster_size - 1)) / image->cluster_size;
+}
+
+// =====================================
+// Get starting lba of a FAT32 cluster in the ESP data region
+// =====================================
+static uint64_t cluster_to_lba(const Gpt_Image *image, const uint32_t cluster) {
+    return image->fat32_data_lba + ((cluster - 2) * image->fat32_lbas_per_cluster);
+}
+
+// =====================================
+// Pick a FAT32 cluster size for an ESP size; use the fatgen103.doc defaults
+//   (4KiB up to 8GiB, doubling up to 32KiB), but keep clusters small enough
+//   that the ESP still has the minimum # of clusters for FAT32
+// =====================================
+static uint64_t default_cluster_size(const Gpt_Image *image, const uint64_t esp_bytes) {
+    uint64_t size = 4096;
+    for (uint64_t limit = 8ULL << 30; esp_bytes > limit && size < FAT32_MAX_CLUSTER_SIZE; limit *= 2)
+        size *= 2;
+
+    while (size > image->lba_size && (esp_bytes - ALIGNMENT) / size < FAT32_MIN_CLUSTERS)
+        size /= 2;
+
+    return size < image->lba_size ? image->lba_size : size;
+}
+
+// =====================================
+// Set an open file's size; new space reads back as 0s. On Windows the file is made
+//   sparse first where the filesystem allows, so unwritten space isn't allocated
+// =====================================
+static bool file_set_size(const int fd, const uint64_t size) {
+#ifdef _WIN32
+    HANDLE file = (HANDLE)_get_osfhandle(fd);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    DWORD bytes;
+    DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL);
+    const LARGE_INTEGER end = { .QuadPart = (LONGLONG)size };
+    return SetFilePointerEx(file, end, NULL, FILE_BEGIN) && SetEndOfFile(file);
+#else
+    return ftruncate(fd, size) == 0;
+#endif
+}
+
+// =====================================
+// Get filesystem block size of an open file, for reflinking file data; 0 if unknown
+// =====================================
+static uint64_t file_block_size(const struct stat *file_stat) {
+#ifdef _WIN32
+    (void)file_stat;
+    return 0;
+#else
+    return file_stat->st_blksize;
+#endif
+}
+
+// =====================================
+// Map all of image->fd into memory, shared so writes go to the file; on Windows a 
+//   fd of -1 maps memory backed only by the page file
+// =====================================
+static bool image_map(Gpt_Image *image, const bool writable) {
+#ifdef _WIN32
+    HANDLE file = image->fd >= 0 ? (HANDLE)_get_osfhandle(image->fd) : INVALID_HANDLE_VALUE;
+    image->mapping = CreateFileMappingA(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+                                        (DWORD)(image->size >> 32), (DWORD)image->size, NULL);
+    if (!image->mapping) return false;
+
+    image->data = MapViewOfFile(image->mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 
+                                (SIZE_T)image->size);
+    if (!image->data) {
+        CloseHandle(image->mapping);
+        return false;
+    }
+    return true;
+#else
+    void *data = mmap(NULL, image->size, writable ? PROT_READ | PROT_WRITE : PROT_READ, 
+                      MAP_SHARED, image->fd, 0);
+    if (data == MAP_FAILED) return false;
+
+    image->data = data;
+    return true;
+#endif
+}
+
+// =====================================
+// Create image file at full size and map it into memory
+// =====================================
+static bool image_open(Gpt_Image *image, const char *name, const uint64_t size) {
+    image->size = size;
+    image->data = NULL;
+
+    image->fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (image->fd < 0) return false;
+
+    // Size file up front; unwritten regions read back as 0s
+    struct stat image_stat;
+    if (!file_set_size(image->fd, size) || fstat(image->fd, &image_stat) != 0 || !image_map(image, true)) {
+        close(image->fd);
+        return false;
+    }
+    image->block_size = file_block_size(&image_stat);
+    return true;
+}
+
+// =====================================
+// Map an anonymous image in memory only, for formats that are converted before being
+//   written out; no file is created. On Linux a memfd backs it, so holes can still be
+//   punched to zero ranges
+// =====================================
+static bool image_open_memory(Gpt_Image *image, const uint64_t size) {
+    image->size = size;
+    image->data = NULL;
+    image->fd = -1;
+    image->block_size = 0;
+
+#ifdef _WIN32
+    return image_map(image, true);
+#else
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+
+#ifdef __linux__
+    image->fd = memfd_create("gptimage", MFD_CLOEXEC);
+    if (image->fd >= 0) {
+        if (ftruncate(image->fd, size) != 0) {
+            close(image->fd);
+            return false;
+        }
+        flags = MAP_SHARED;
+    }
+#endif
+
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, image->fd, 0);
+    if (data == MAP_FAILED) {
+        if (image->fd >= 0) close(image->fd);
+        return false;
+    }
+
+    image->data = data;
+    return true;
+#endif
+}
+
+// =====================================
+// Open an existing image file and map it into memory, for updating it in place,
+//   or read only for verifying it
+// =====================================
+static bool image_open_existing(Gpt_Image *image, const char *name, const bool read_only) {
+    image->data = NULL;
+
+    image->fd = open(name, (read_only ? O_RDONLY : O_RDWR) | O_BINARY);
+    if (image->fd < 0) return false;
+
+    struct stat image_stat;
+    if (fstat(image->fd, &image_stat) != 0 || image_stat.st_size < 4096) {
+        close(image->fd);
+        return false;
+    }
+    image->size = image_stat.st_size;
+    image->block_size = file_block_size(&image_stat);
+
+    if (!image_map(image, !read_only)) {
+        close(image->fd);
+        return false;
+    }
+    return true;
+}
+
+// =====================================
+// Unmap and close image file
+// =====================================
+static void image_close(Gpt_Image *image) {
+#ifdef _WIN32
+    UnmapViewOfFile(image->data);
+    CloseHandle(image->mapping);
+#else
+    munmap(image->data, image->size);
+#endif
+    if (image->fd >= 0) close(image->fd);
+}
+
+// =====================================
+// Get pointer to start of a given lba in the mapped image
+// =====================================
+static void *image_lba(const Gpt_Image *image, const uint64_t lba) {
+    return image->data + (lba * image->lba_size);
+}
+
+// =====================================
+// Check if a buffer is all 0s
+// =====================================
+static bool is_zero(const void *buf, const uint64_t size) {
+    const uint8_t *bufp = buf;
+    return size == 0 || (bufp[0] == 0 && !memcmp(bufp, bufp + 1, size - 1));
+}
+
+// =====================================
+// Check if a range of the image is all 0s; holes in the image file are found without
+//   reading them, where the filesystem can tell
+// =====================================
+static bool image_is_zero(const Gpt_Image *image, const uint64_t offset, const uint64_t size) {
+#ifdef SEEK_DATA
+    const off_t data_start = lseek(image->fd, offset, SEEK_DATA);
+    if ((data_start < 0 && errno == ENXIO) || 
+        (data_start >= 0 && (uint64_t)data_start >= offset + size))
+        return true;
+#endif
+    return is_zero(image->data + offset, size);
+}
+
+// =====================================
+// Write data to an lba in the image, skipping sectors that are all 0s;
+//   the image file is created sparse, so skipped sectors are never allocated
+// =====================================
+static void image_write_lbas(Gpt_Image *image, const uint64_t lba, const void *buf, const uint64_t size) {
+    const uint8_t *bufp = buf;
+    uint8_t *dest = image_lba(image, lba);
+
+    for (uint64_t i = 0; i < size; i += image->lba_size) {
+        const uint64_t len = (size - i < image->lba_size) ? size - i : image->lba_size;
+        if (!is_zero(bufp + i, len)) memcpy(dest + i, bufp + i, len);
+    }
+}
+
+// =====================================
+// Zero a range of lbas in the image, before overwriting old data in place;
+//   deallocates the range where the filesystem allows it, to keep the image sparse
+// =====================================
+static void image_zero_lbas(Gpt_Image *image, const uint64_t lba, const uint64_t num_lbas) {
+#ifdef __linux__
+    if (fallocate(image->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+                  lba * image->lba_size, num_lbas * image->lba_size) == 0)
+        return;
+#endif
+    memset(image_lba(image, lba), 0, num_lbas * image->lba_size);
+}
+
+#ifdef __linux__
+// =====================================
+// Copy a file's data into the image at a byte offset without passing it through
+//   user space; reflink (share extents with the file) where the filesystem allows it,
+//   otherwise copy_file_range each data extent, leaving holes in the file as holes.
+//   Returns false if the kernel/filesystem can't do this, to fall back to read/write
+// =====================================
+static bool copy_file_range_to_image(const int file_fd, Gpt_Image *image, const uint64_t offset, 
+                                     const uint64_t size) {
+    // A file that changed size since it was planned is left to read/write to catch;
+    //   a hole past a truncated end would otherwise look like a trailing hole
+    struct stat file_stat;
+    if (fstat(file_fd, &file_stat) != 0 || (uint64_t)file_stat.st_size != size) return false;
+
+    uint64_t done = 0;
+
+    // Reflink the filesystem block aligned part of the file
+    if (image->block_size > 0 && offset % image->block_size == 0) {
+        struct file_clone_range range = {
+            .src_fd = file_fd,
+            .src_offset = 0,
+            .src_length = size - (size % image->block_size),
+            .dest_offset = offset,
+        };
+
+        if (range.src_length > 0 && ioctl(image->fd, FICLONERANGE, &range) == 0)
+            done = range.src_length;
+    }
+
+    // Copy the rest of the file's data extents
+    off_t file_pos = done;
+    while ((uint64_t)file_pos < size) {
+        off_t data_start = lseek(file_fd, file_pos, SEEK_DATA);
+        if (data_start < 0) {
+            if (errno == ENXIO) break;  // Only a hole left until end of file
+            data_start = file_pos;      // SEEK_DATA not supported, treat all as data
+        }
+        if ((uint64_t)data_start >= size) break;
+
+        off_t data_end = lseek(file_fd, data_start, SEEK_HOLE);
+        if (data_end < 0 || (uint64_t)data_end > size) data_end = size;
+
+        off_t in_pos = data_start;
+        off_t out_pos = offset + data_start;
+        while (in_pos < data_end) {
+            if (copy_file_range(file_fd, &in_pos, image->fd, &out_pos, data_end - in_pos, 0) <= 0)
+                return false;
+        }
+        file_pos = data_end;
+    }
+
+    return true;
+}
+#endif
+
+// =====================================
+// Copy a file's data into the image starting at a given lba; optionally return the
+//   CRC32 of the file data in crc, if it was read on the way. Data the kernel reflinked
+//   or copied is not read back just for a CRC32, has_crc is then false
+// =====================================
+static bool copy_file_to_image(FILE *file, Gpt_Image *image, const uint64_t lba, const uint64_t size, 
+                               uint32_t *crc, bool *has_crc) {
+    if (has_crc) *has_crc = crc != NULL;
+
+    // Small files are read straight into the mapped image, 1 read() each; no extents to
+    //   find or share, and no bounce buffer
+    if (size <= SMALL_FILE_SIZE) {
+        uint8_t *dest = image_lba(image, lba);
+        uint64_t done = 0;
+        ssize_t len = 0;
+        while (done < size && (len = read(fileno(file), dest + done, size - done)) > 0)
+            done += len;
+
+        if (done != size) return false;
+        if (crc) *crc = calculate_crc32(dest, size);
+        return true;
+    }
+
+#ifdef __linux__
+    if (copy_file_range_to_image(fileno(file), image, lba * image->lba_size, size)) {
+        if (has_crc) *has_crc = false;
+        return true;
+    }
+
+    // Fall back to read/write, from the start of the file
+    rewind(file);
+#endif
+
+    const uint64_t chunk_size = ALIGNMENT;
+    uint8_t *chunk = malloc(chunk_size);
+    if (!chunk) return false;
+
+    bool result = true;
+    if (crc) *crc = 0;
+    for (uint64_t offset = 0; offset < size; offset += chunk_size) {
+        const uint64_t len = (size - offset < chunk_size) ? size - offset : chunk_size;
+        if (fread(chunk, 1, len, file) != len) {
+            result = false;
+            break;
+        }
+        if (crc) *crc = crc32_update(*crc, chunk, len);
+        image_write_lbas(image, lba + (offset / image->lba_size), chunk, len);
+    }
+
+    free(chunk);
+    return result;
+}
+
+// =====================================
+// Get CRC32 of a local file's data, to compare with data already in an image
+// =====================================
+static bool file_crc32(const char *filepath, uint32_t *crc) {
+    FILE *fp = fopen(filepath, "rb");
+    if (!fp) return false;
+
+    const uint64_t chunk_size = ALIGNMENT;
+    uint8_t *chunk = malloc(chunk_size);
+    if (!chunk) {
+        fclose(fp);
+        return false;
+    }
+
+    size_t len;
+    *crc = 0;
+    while ((len = fread(chunk, 1, chunk_size, fp)) > 0)
+        *crc = crc32_update(*crc, chunk, len);
+
+    const bool result = !ferror(fp);
+    free(chunk);
+    fclose(fp);
+    return result;
+}
+
+// =====================================
+// Parse a stdin input arg "-:NAME[:SIZE]"; file data is read from stdin and added as NAME.
+//   SIZE is optional, if not given size is UINT64_MAX and is found at end of stdin.
+//   Returns false if arg is not a stdin input
+// =====================================
+static bool parse_stdin_arg(const char *arg, char *name, const size_t name_size, uint64_t *size) {
+    if (strncmp(arg, "-:", 2)) return false;
+
+    const char *name_start = arg + 2;
+    const char *colon = strchr(name_start, ':');
+    size_t name_len = colon ? (size_t)(colon - name_start) : strlen(name_start);
+    if (name_len >= name_size) name_len = name_size - 1;
+
+    memcpy(name, name_start, name_len);
+    name[name_len] = '\0';
+
+    *size = colon ? strtoull(colon + 1, NULL, 10) : UINT64_MAX;
+    return true;
+}
+
+// =====================================
+// Open a local input file. Regular files only get their size here, they are opened by
+//   the copy workers later. stdin ("-:NAME[:SIZE]"), pipes & other files that can only be
+//   read once, in order, are opened as a stream; size is the given size, or UINT64_MAX
+//   if it is only known at end of stream
+// =====================================
+static bool open_input(const char *filepath, FILE **stream, uint64_t *size) {
+    static atomic_flag stdin_used = ATOMIC_FLAG_INIT;  // Shared by all images in the process
+    char name[256];
+
+    *stream = NULL;
+    if (parse_stdin_arg(filepath, name, sizeof name, size)) {
+        if (atomic_flag_test_and_set(&stdin_used)) {
+            fprintf(stderr, "Error: stdin can only be used for 1 file, '%s'\n", filepath);
+            return false;
+        }
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        *stream = stdin;
+        return true;
+    }
+
+    struct stat file_stat;
+    if (stat(filepath, &file_stat) != 0 || S_ISDIR(file_stat.st_mode)) {
+        fprintf(stderr, "Error: Could not open file '%s'\n", filepath);
+        return false;
+    }
+
+    if (S_ISREG(file_stat.st_mode)) {
+        *size = file_stat.st_size;
+        return true;
+    }
+
+    *stream = fopen(filepath, "rb");
+    if (!*stream) {
+        fprintf(stderr, "Error: Could not open file '%s'\n", filepath);
+        return false;
+    }
+    *size = UINT64_MAX;
+    return true;
+}
+
+// =====================================
+// Close a stream from open_input()
+// =====================================
+static void close_input(FILE *stream) {
+    if (stream && stream != stdin) fclose(stream);
+}
+
+// =====================================
+// Copy a stream's data into the image at a given lba until end of stream; fails if the
+//   stream has more than max_size bytes. Gets # of bytes copied in size, and CRC32 of
+//   the data in crc
+// =====================================
+static bool copy_stream_to_image(FILE *stream, Gpt_Image *image, const uint64_t lba, const uint64_t max_size,
+                                 uint64_t *size, uint32_t *crc) {
+    const uint64_t chunk_size = ALIGNMENT;
+    uint8_t *chunk = malloc(chunk_size);
+    if (!chunk) return false;
+
+    bool result = true;
+    *size = 0;
+    *crc = 0;
+
+    // fread() only returns less than a full chunk at end of stream, so each chunk
+    //   starts on an lba
+    size_t len;
+    while ((len = fread(chunk, 1, chunk_size, stream)) > 0) {
+        if (len > max_size - *size) {
+            result = false;     // More data than room for it
+            break;
+        }
+        *crc = crc32_update(*crc, chunk, len);
+        image_write_lbas(image, lba + (*size / image->lba_size), chunk, len);
+        *size += len;
+    }
+
+    if (ferror(stream)) result = false;
+    free(chunk);
+    return result;
+}
+
+// =====================================
+// Write info for all data partition files to DATAFLS.INF ("Data (partition) files info"),
+//   in the order they were added; the file is built in a malloc-ed buffer, not on disk
+// =====================================
+static bool write_data_files_info(const Gpt_Image *image, char **buf, size_t *size) {
+    // Each entry is its name plus at most 96 bytes of keys, digits & newlines
+    size_t cap = 1;
+    for (uint64_t i = 0; i < image->num_data_files; i++) 
+        if (image->data_files[i].name) cap += strlen(image->data_files[i].name) + 96;
+
+    *size = 0;
+    *buf = malloc(cap);
+    if (!*buf) {
+        fprintf(stderr, "Error: Could not allocate memory for DATAFLS.INF\n");
+        return false;
+    }
+
+    for (uint64_t i = 0; i < image->num_data_files; i++) {
+        const Data_File *file = &image->data_files[i];
+        if (!file->name) continue;  // File data could not be copied
+
+        char *p = *buf + *size;
+        p += sprintf(p, "FILE_NAME=%s\nFILE_SIZE=%"PRIu64"\n", file->name, file->size);
+        if (file->has_crc32) p += sprintf(p, "FILE_CRC32=%08"PRIX32"\n", file->crc32);
+        p += sprintf(p, "DISK_LBA=%"PRIu64"\n\n", file->lba);  // Add extra line between files
+        *size = p - *buf;
+    }
+    return true;
+}
+
+// =====================================
+// Worker thread; take & copy planned files until none are left in the batch.
+//   Each worker only has 1 file open at a time, and writes to its own
+//   clusters/lbas of the image
+// =====================================
+static void *copy_worker(void *arg) {
+    Gpt_Image *image = arg;
+
+    uint32_t i;
+    while ((i = atomic_fetch_add(&image->next_copy_job, 1)) < image->num_copy_jobs) {
+        Copy_Job *job = &image->copy_jobs[i];
+
+        FILE *fp = fopen(job->filepath, "rb");
+        if (!fp || !copy_file_to_image(fp, image, job->lba, job->size,
+                                       job->data_file >= 0 ? &job->crc32 : NULL, &job->has_crc32)) {
+            fprintf(stderr, "Error: Could not read file data for '%s'\n", job->filepath);
+            job->error = true;
+        }
+        if (fp) fclose(fp);
+    }
+
+    return NULL;
+}
+
+// =====================================
+// Copy all planned files in the current batch into the image in parallel,
+//   then save CRC32s of copied data partition files for DATAFLS.INF
+// =====================================
+static bool run_copy_jobs(Gpt_Image *image) {
+    if (image->num_copy_jobs == 0) return true;
+
+    // Main thread also copies, so start 1 less worker thread
+    atomic_store(&image->next_copy_job, 0);
+    const uint32_t num_threads = image->num_copy_threads < image->num_copy_jobs ?
+                                 image->num_copy_threads : image->num_copy_jobs;
+    pthread_t *threads = calloc(num_threads, sizeof *threads);
+    uint32_t num_started = 0;
+    while (threads && num_started < num_threads - 1 &&
+           pthread_create(&threads[num_started], NULL, copy_worker, image) == 0)
+        num_started++;
+
+    copy_worker(image);
+
+    for (uint32_t i = 0; i < num_started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    bool result = true;
+    for (uint32_t i = 0; i < image->num_copy_jobs; i++) {
+        Copy_Job *job = &image->copy_jobs[i];
+        if (job->data_file >= 0) {
+            Data_File *file = &image->data_files[job->data_file];
+            if (job->has_crc32) {
+                file->crc32 = job->crc32;
+                file->has_crc32 = true;
+            }
+            if (job->error) {
+                free(file->name);
+                file->name = NULL;  // Don't list file in DATAFLS.INF
+            }
+        }
+        if (job->error) result = false;
+        free(job->filepath);
+    }
+    image->num_copy_jobs = 0;
+    if (!result) image->copy_failed = true;
+
+    return result;
+}
+
+// =====================================
+// Plan a copy of a local file into the image at a given lba, data_file is the file's
+//   index in data_files[] or -1 for ESP files; copies are done in batches
+//   of up to MAX_COPY_JOBS files, to bound memory use for any number of files
+// =====================================
+static bool queue_copy_job(Gpt_Image *image, const char *filepath, const uint64_t lba, 
+                           const uint64_t size, const int64_t data_file) {
+    if (!image->copy_jobs) {
+        image->copy_jobs = malloc(MAX_COPY_JOBS * sizeof *image->copy_jobs);
+        if (!image->copy_jobs) return false;
+    }
+
+    // Batch is full, copy it before planning more; errors are reported per file, and
+    //   kept in copy_failed for finalize
+    if (image->num_copy_jobs == MAX_COPY_JOBS) run_copy_jobs(image);
+
+    char *path_copy = strdup(filepath);
+    if (!path_copy) return false;
+
+    image->copy_jobs[image->num_copy_jobs++] = (Copy_Job){
+        .filepath = path_copy,
+        .lba = lba,
+        .size = size,
+        .data_file = data_file,
+    };
+    return true;
+}
+
+// =====================================
+// Get next highest aligned lba value after input lba
+// =====================================
+static uint64_t next_aligned_lba(const Gpt_Image *image, const uint64_t lba) {
+    return lba - (lba % image->align_lba) + image->align_lba;
+}
+
+// =====================================
+// Fill a buffer with random bytes from the OS
+// =====================================
+static bool os_random(uint8_t *buf, const size_t size) {
+#ifdef _WIN32
+    for (size_t i = 0; i < size; i += sizeof(unsigned int)) {
+        unsigned int r;
+        if (rand_s(&r) != 0) return false;
+        memcpy(buf + i, &r, size - i < sizeof r ? size - i : sizeof r);
+    }
+    return true;
+#else
+    return getrandom(buf, size, 0) == (ssize_t)size;
+#endif
+}
+
+// =====================================
+// Create a new Version 4 Variant 2 GUID; random bytes come from the OS, so
+//   there is no shared PRNG state between threads/images
+// =====================================
+static Guid new_guid(void) {
+    uint8_t rand_arr[16] = { 0 };
+
+    if (!os_random(rand_arr, sizeof rand_arr)) {
+        // No kernel randomness; mix time & a process wide counter (splitmix64) instead
+        static atomic_uint_fast64_t state;
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        for (uint8_t i = 0; i < sizeof rand_arr; i += 8) {
+            uint64_t z = atomic_fetch_add(&state, 0x9E3779B97F4A7C15ULL) ^ 
+                         ((uint64_t)now.tv_sec << 30) ^ (uint64_t)now.tv_nsec;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            z ^= z >> 31;
+            memcpy(&rand_arr[i], &z, 8);
+        }
+    }
+
+    // Fill out GUID
+    Guid result = {
+        .time_lo         = *(uint32_t *)&rand_arr[0],
+        .time_mid        = *(uint16_t *)&rand_arr[4],
+        .time_hi_and_ver = *(uint16_t *)&rand_arr[6],
+        .clock_seq_hi_and_res = rand_arr[8],
+        .clock_seq_lo = rand_arr[9],
+        .node = { rand_arr[10], rand_arr[11], rand_arr[12], rand_arr[13],
+                  rand_arr[14], rand_arr[15] },
+    };
+
+    // Fill out version bits - version 4
+    result.time_hi_and_ver &= ~(1 << 15); // 0b_0_111 1111
+    result.time_hi_and_ver |= (1 << 14);  // 0b0_1_00 0000
+    result.time_hi_and_ver &= ~(1 << 13); // 0b11_0_1 1111
+    result.time_hi_and_ver &= ~(1 << 12); // 0b111_0_ 1111
+
+    // Fill out variant bits
+    result.clock_seq_hi_and_res |= (1 << 7);    // 0b_1_000 0000
+    result.clock_seq_hi_and_res |= (1 << 6);    // 0b0_1_00 0000
+    result.clock_seq_hi_and_res &= ~(1 << 5);   // 0b11_0_1 1111
+
+    return result;
+}
+
+// =====================================
+// Get new date/time values for FAT32 directory entries; converted once per second,
+//   as localtime() can check the timezone file on each call. Cached per thread
+// ===================================== 
+static void get_fat_dir_entry_time_date(uint16_t *in_time, uint16_t *in_date) {
+    static _Thread_local time_t last_time = -1;
+    static _Thread_local uint16_t last_fat_time = 0, last_fat_date = 0;
+
+    const time_t curr_time = time(NULL);
+    if (curr_time != last_time) {
+        struct tm tm;
+        localtime_r(&curr_time, &tm);
+
+        // FAT32 needs # of years since 1980, localtime returns tm_year as # years since 1900,
+        //   subtract 80 years for correct year value. Also convert month of year from 0-11 to 1-12
+        //   by adding 1
+        last_fat_date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+
+        // Seconds is # 2-second count, 0-29
+        if (tm.tm_sec == 60) tm.tm_sec = 59;
+        last_fat_time = tm.tm_hour << 11 | tm.tm_min << 5 | (tm.tm_sec / 2);
+        last_time = curr_time;
+    }
+
+    *in_date = last_fat_date;
+    *in_time = last_fat_time;
+}
+
+// =====================================
+// Write protective MBR
+// ===================================== 
+static bool write_mbr(Gpt_Image *image) {
+    uint64_t mbr_image_lbas = image->image_size_lbas;
+    if (mbr_image_lbas > 0xFFFFFFFF) mbr_image_lbas = 0x100000000;
+
+    Mbr mbr = {
+        .boot_code = { 0 },
+        .mbr_signature = 0,
+        .unknown = 0,
+        .partition[0] = {
+            .boot_indicator = 0,
+            .starting_chs = { 0x00, 0x02, 0x00 },
+            .os_type = 0xEE,        // Protective GPT
+            .ending_chs = { 0xFF, 0xFF, 0xFF },
+            .starting_lba = 0x00000001,
+            .size_lba = mbr_image_lbas - 1,
+        },
+        .boot_signature = 0xAA55,
+    };
+
+    if (image->size < image->lba_size) return false;
+    memcpy(image_lba(image, 0), &mbr, sizeof mbr);
+
+    return true;
+}
+// =====================================
+// Write GPT headers & tables, primary & secondary
+// =====================================
+static bool write_gpts(Gpt_Image *image) {
+    // Fill out primary GPT header
+    Gpt_Header primary_gpt = {
+        .signature = { "EFI PART" },
+        .revision = 0x00010000,   // Version 1.0
+        .header_size = 92,
+        .header_crc32 = 0,      // Will calculate later
+        .reserved_1 = 0,
+        .my_lba = 1,            // LBA 1 is right after MBR
+        .alternate_lba = image->image_size_lbas - 1,
+        .first_usable_lba = 1 + 1 + image->gpt_table_lbas, // MBR + GPT header + primary gpt table
+        .last_usable_lba = image->image_size_lbas - 1 - image->gpt_table_lbas - 1, // 2nd GPT header + table
+        .disk_guid = new_guid(),
+        .partition_table_lba = 2,   // After MBR + GPT header
+        .number_of_entries = 128,   
+        .size_of_entry = 128,
+        .partition_table_crc32 = 0, // Will calculate later
+        .reserved_2 = { 0 },
+    };
+
+    // Fill out primary table partition entries
+    Gpt_Partition_Entry gpt_table[NUMBER_OF_GPT_TABLE_ENTRIES] = {
+        // EFI System Paritition
+        {
+            .partition_type_guid = ESP_GUID,
+            .unique_guid = new_guid(),
+            .starting_lba = image->esp_lba,
+            .ending_lba = image->esp_lba + image->esp_size_lbas - 1,     // Inclusive
+            .attributes = 0,
+            .name = u"EFI SYSTEM",
+        },
+
+        // Basic Data Paritition
+        {
+            .partition_type_guid = BASIC_DATA_GUID,
+            .unique_guid = new_guid(),
+            .starting_lba = image->data_lba,
+            .ending_lba = image->data_lba + image->data_size_lbas - 1,   // Inclusive
+            .attributes = 0,
+            .name = u"BASIC DATA",
+        },
+    };
+
+    // Extra partitions from -p layout specs
+    for (uint32_t i = 0; i < image->num_partitions; i++) {
+        const Partition *part = &image->partitions[i];
+        Gpt_Partition_Entry *entry = &gpt_table[2 + i];
+        entry->partition_type_guid = part->type_guid;
+        entry->unique_guid = new_guid();
+        entry->starting_lba = part->lba;
+        entry->ending_lba = part->lba + part->size_lbas - 1;
+        for (size_t j = 0; part->name[j]; j++)
+            entry->name[j] = part->name[j];
+    }
+
+    // Fill out primary header CRC values
+    primary_gpt.partition_table_crc32 = calculate_crc32(gpt_table, sizeof gpt_table);
+    primary_gpt.header_crc32 = calculate_crc32(&primary_gpt, primary_gpt.header_size);
+
+    // Secondary header is the last lba of the image
+    if (image->size < image->image_size_lbas * image->lba_size) return false;
+
+    // Write primary gpt header & table to image
+    memcpy(image_lba(image, primary_gpt.my_lba), &primary_gpt, sizeof primary_gpt);
+    image_write_lbas(image, primary_gpt.partition_table_lba, &gpt_table, sizeof gpt_table);
+
+    // Fill out secondary GPT header
+    Gpt_Header secondary_gpt = primary_gpt;
+
+    secondary_gpt.header_crc32 = 0;
+    secondary_gpt.partition_table_crc32 = 0;
+    secondary_gpt.my_lba = primary_gpt.alternate_lba;
+    secondary_gpt.alternate_lba = primary_gpt.my_lba;
+    secondary_gpt.partition_table_lba = image->image_size_lbas - 1 - image->gpt_table_lbas;
+
+    // Fill out secondary header CRC values
+    secondary_gpt.partition_table_crc32 = calculate_crc32(gpt_table, sizeof gpt_table);
+    secondary_gpt.header_crc32 = calculate_crc32(&secondary_gpt, secondary_gpt.header_size);
+
+    // Write secondary gpt table & header to image
+    image_write_lbas(image, secondary_gpt.partition_table_lba, &gpt_table, sizeof gpt_table);
+    memcpy(image_lba(image, secondary_gpt.my_lba), &secondary_gpt, sizeof secondary_gpt);
+
+    return true;
+}
+
+// =====================================
+// Parse a GUID string, e.g. "0FC63DAF-8483-4772-8E79-3D69D8477DE4"
+// =====================================
+static bool parse_guid(const char *str, Guid *guid) {
+    uint32_t time_lo;
+    uint16_t time_mid, time_hi_and_ver;
+    uint8_t bytes[8];
+    int len = 0;
+
+    if (sscanf(str, "%8"SCNx32"-%4"SCNx16"-%4"SCNx16"-%2"SCNx8"%2"SCNx8"-"
+                    "%2"SCNx8"%2"SCNx8"%2"SCNx8"%2"SCNx8"%2"SCNx8"%2"SCNx8"%n",
+               &time_lo, &time_mid, &time_hi_and_ver, &bytes[0], &bytes[1], 
+               &bytes[2], &bytes[3], &bytes[4], &bytes[5], &bytes[6], &bytes[7], &len) != 11 ||
+        len != 36 || str[len] != '\0')
+        return false;
+
+    guid->time_lo = time_lo;
+    guid->time_mid = time_mid;
+    guid->time_hi_and_ver = time_hi_and_ver;
+    guid->clock_seq_hi_and_res = bytes[0];
+    guid->clock_seq_lo = bytes[1];
+    memcpy(guid->node, &bytes[2], sizeof guid->node);
+    return true;
+}
+
+// =====================================
+// Parse a -p layout spec, e.g. "type=linux,size=512,name=ROOT_A,file=root.img";
+//   type is esp/data/linux/swap or a type GUID, size is in MiB (default is the size
+//   of file rounded up to MiB), align is in bytes (default 1 MiB)
+// =====================================
+static bool parse_partition(const char *spec, Partition *part) {
+    *part = (Partition){ .align = ALIGNMENT };
+    bool has_type = false;
+
+    // Tokenize a private copy, leaving the caller's spec as is
+    part->spec = strdup(spec);
+    if (!part->spec) {
+        fprintf(stderr, "Error: Could not allocate memory for partition spec '%s'\n", spec);
+        return false;
+    }
+
+    char *save = NULL;
+    for (char *key = strtok_r(part->spec, ",", &save); key; key = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(key, '=');
+        if (!value) {
+            fprintf(stderr, "Error: Expected key=value in partition spec, got '%s'\n", key);
+            return false;
+        }
+        *value++ = '\0';
+
+        if (!strcmp(key, "type")) {
+            // Common partition types by name, or any type GUID
+            const Guid linux_guid = { 0x0FC63DAF, 0x8483, 0x4772, 0x8E, 0x79, 
+                                      { 0x3D, 0x69, 0xD8, 0x47, 0x7D, 0xE4 } };
+            const Guid swap_guid  = { 0x0657FD6D, 0xA4AB, 0x43C4, 0x84, 0xE5, 
+                                      { 0x09, 0x33, 0xC8, 0x4B, 0x4F, 0x4F } };
+            if      (!strcmp(value, "esp"))   part->type_guid = ESP_GUID;
+            else if (!strcmp(value, "data"))  part->type_guid = BASIC_DATA_GUID;
+            else if (!strcmp(value, "linux")) part->type_guid = linux_guid;
+            else if (!strcmp(value, "swap"))  part->type_guid = swap_guid;
+            else if (!parse_guid(value, &part->type_guid)) {
+                fprintf(stderr, "Error: Invalid partition type '%s', must be esp/data/linux/swap "
+                                "or a GUID\n", value);
+                return false;
+            }
+            has_type = true;
+        } else if (!strcmp(key, "size")) {
+            part->size = strtoull(value, NULL, 10);
+            if (part->size == 0 || part->size > (INT64_MAX / 2) / ALIGNMENT) {
+                fprintf(stderr, "Error: Invalid partition size '%s' MiB\n", value);
+                return false;
+            }
+            part->size *= ALIGNMENT;
+        } else if (!strcmp(key, "align")) {
+            part->align = strtoull(value, NULL, 10);
+            if (part->align < 512 || part->align > (1ULL << 30) || (part->align & (part->align - 1))) {
+                fprintf(stderr, "Error: Invalid partition alignment '%s', must be a power of 2 "
+                                "from 512 to 1 GiB\n", value);
+                return false;
+            }
+        } else if (!strcmp(key, "name")) {
+            if (strlen(value) >= sizeof part->name) {
+                fprintf(stderr, "Error: Partition name '%s' is longer than 36 characters\n", value);
+                return false;
+            }
+            strcpy(part->name, value);
+        } else if (!strcmp(key, "file")) {
+            part->filepath = value;
+        } else {
+            fprintf(stderr, "Error: Unknown partition spec key '%s'\n", key);
+            return false;
+        }
+    }
+
+    if (!has_type || (!part->size && !part->filepath)) {
+        fprintf(stderr, "Error: Partition spec needs a type, and a size and/or file\n");
+        return false;
+    }
+    return true;
+}
+
+// =====================================
+// Place extra partitions in order after the Basic Data Partition, each on its own 
+//   alignment, and grow the image to fit them; sizes of partitions without a size
+//   are taken from their file
+// =====================================
+static bool layout_partitions(Gpt_Image *image) {
+    uint64_t next_lba = image->data_lba + image->data_size_lbas;  // After Basic Data ending lba
+
+    for (uint32_t i = 0; i < image->num_partitions; i++) {
+        Partition *part = &image->partitions[i];
+
+        if (part->filepath) {
+            if (!open_input(part->filepath, &part->stream, &part->file_size)) return false;
+
+            if (!part->size && part->file_size == UINT64_MAX) {
+                fprintf(stderr, "Error: Partition for stream '%s' needs a size\n", part->filepath);
+                return false;
+            }
+            if (!part->size) 
+                part->size = ((part->file_size + ALIGNMENT - 1) / ALIGNMENT) * ALIGNMENT;
+            if (!part->size) part->size = ALIGNMENT;   // Empty file
+
+            if (part->file_size != UINT64_MAX && part->file_size > part->size) {
+                fprintf(stderr, "Error: '%s' is %"PRIu64" bytes, larger than its %"PRIu64" MiB partition\n",
+                        part->filepath, part->file_size, part->size / ALIGNMENT);
+                return false;
+            }
+        }
+
+        const uint64_t align_lbas = part->align > image->lba_size ? part->align / image->lba_size : 1;
+        part->lba = ((next_lba + align_lbas - 1) / align_lbas) * align_lbas;
+        part->size_lbas = bytes_to_lbas(image, part->size);
+        next_lba = part->lba + part->size_lbas;
+    }
+
+    // Secondary GPT table & header go after the last partition
+    if (next_lba + image->gpt_table_lbas + 1 > image->image_size_lbas) {
+        image->image_size_lbas = next_lba + image->gpt_table_lbas + 1;
+        image->image_size = image->image_size_lbas * image->lba_size;
+    }
+    return true;
+}
+
+// =====================================
+// Fill extra partitions with their raw contents; files are planned copies like all
+//   other file data, streams are copied now
+// =====================================
+static bool write_partitions(Gpt_Image *image) {
+    bool result = true;
+
+    for (uint32_t i = 0; i < image->num_partitions; i++) {
+        Partition *part = &image->partitions[i];
+        if (!part->filepath) continue;
+
+        if (!part->stream) {
+            if (!queue_copy_job(image, part->filepath, part->lba, part->file_size, -1)) {
+                fprintf(stderr, "Error: Could not allocate memory for file copy '%s'\n", part->filepath);
+                result = false;
+            }
+            continue;
+        }
+
+        uint64_t size = 0;
+        uint32_t crc = 0;
+        if (!copy_stream_to_image(part->stream, image, part->lba, part->size, &size, &crc)) {
+            fprintf(stderr, "Error: Could not read '%s', or it is larger than its partition\n", 
+                    part->filepath);
+            result = false;
+        } else if (part->file_size != UINT64_MAX && size != part->file_size) {
+            fprintf(stderr, "Error: '%s' has %"PRIu64" bytes, expected %"PRIu64"\n", 
+                    part->filepath, size, part->file_size);
+            result = false;
+        } else if (!image->config.quiet) {
+            printf("Added '%s' to partition %"PRIu32"\n", part->filepath, i + 3);
+        }
+        close_input(part->stream);
+        part->stream = NULL;
+    }
+
+    return result;
+}
+
+// =====================================
+// Read & check GPT headers & tables of an existing image made by this program;
+//   sets lba size, partition sizes & LBA values from them
+// =====================================
+static bool read_gpts(Gpt_Image *image) {
+    // Find lba size from where the primary GPT header is
+    const uint32_t lba_sizes[] = { 512, 1024, 2048, 4096 };
+    image->lba_size = 0;
+    for (size_t i = 0; i < sizeof lba_sizes / sizeof lba_sizes[0]; i++) {
+        if (image->size >= lba_sizes[i] * 2 && 
+            !memcmp(image->data + lba_sizes[i], "EFI PART", 8)) {
+            image->lba_size = lba_sizes[i];
+            break;
+        }
+    }
+
+    const Mbr *mbr = image_lba(image, 0);
+    if (!image->lba_size || mbr->boot_signature != 0xAA55 || mbr->partition[0].os_type != 0xEE) {
+        fprintf(stderr, "Error: No protective MBR & GPT header found\n");
+        return false;
+    }
+
+    // Check header & table CRCs, primary & secondary
+    image->gpt_table_lbas = GPT_TABLE_SIZE / image->lba_size;
+    const uint64_t image_lbas = image->size / image->lba_size;
+    Gpt_Header primary_gpt = *(Gpt_Header *)image_lba(image, 1);
+    if (primary_gpt.header_size < 92 || primary_gpt.header_size > sizeof primary_gpt ||
+        primary_gpt.alternate_lba >= image_lbas ||
+        primary_gpt.number_of_entries != NUMBER_OF_GPT_TABLE_ENTRIES ||
+        primary_gpt.size_of_entry != GPT_TABLE_ENTRY_SIZE ||
+        primary_gpt.partition_table_lba + image->gpt_table_lbas > image_lbas) {
+        fprintf(stderr, "Error: Invalid primary GPT header\n");
+        return false;
+    }
+
+    for (uint8_t i = 0; i < 2; i++) {
+        const uint64_t header_lba = (i == 0) ? 1 : primary_gpt.alternate_lba;
+        Gpt_Header gpt = *(Gpt_Header *)image_lba(image, header_lba);
+        const uint32_t header_crc32 = gpt.header_crc32;
+        gpt.header_crc32 = 0;
+
+        if (memcmp(gpt.signature, "EFI PART", 8) || 
+            gpt.header_size != primary_gpt.header_size ||
+            gpt.partition_table_lba + image->gpt_table_lbas > image_lbas ||
+            calculate_crc32(&gpt, gpt.header_size) != header_crc32 ||
+            calculate_crc32(image_lba(image, gpt.partition_table_lba), GPT_TABLE_SIZE) != 
+                gpt.partition_table_crc32) {
+            fprintf(stderr, "Error: %s GPT header or table is invalid\n", i == 0 ? "Primary" : "Secondary");
+            return false;
+        }
+    }
+
+    // ESP is the 1st partition, Basic Data the 2nd
+    const Gpt_Partition_Entry *gpt_table = image_lba(image, primary_gpt.partition_table_lba);
+    if (memcmp(&gpt_table[0].partition_type_guid, &ESP_GUID, sizeof ESP_GUID) ||
+        memcmp(&gpt_table[1].partition_type_guid, &BASIC_DATA_GUID, sizeof BASIC_DATA_GUID) ||
+        gpt_table[0].ending_lba < gpt_table[0].starting_lba ||
+        gpt_table[1].ending_lba < gpt_table[1].starting_lba ||
+        gpt_table[1].ending_lba > primary_gpt.last_usable_lba) {
+        fprintf(stderr, "Error: Expected an EFI System Partition followed by a Basic Data Partition\n");
+        return false;
+    }
+
+    image->image_size_lbas = primary_gpt.alternate_lba + 1;
+    image->image_size = image->image_size_lbas * image->lba_size;
+    image->align_lba = ALIGNMENT / image->lba_size;
+    image->esp_lba = gpt_table[0].starting_lba;
+    image->data_lba = gpt_table[1].starting_lba;
+    if ((image->esp_lba + 1) * image->lba_size > image->size) {
+        fprintf(stderr, "Error: EFI System Partition starts past the end of the image\n");
+        return false;
+    }
+
+    // Ending lbas are inclusive. Older images from this tool wrote the ESP & Basic Data
+    //   ending lbas 1 past the end; their ESP VBR gives the exclusive size, and sizes
+    //   are read the same way for both partitions
+    const Vbr *vbr = image_lba(image, image->esp_lba);
+    const uint64_t end_adjust = vbr->BPB_TotSec32 == gpt_table[0].ending_lba - gpt_table[0].starting_lba ? 0 : 1;
+    image->esp_size_lbas = gpt_table[0].ending_lba - gpt_table[0].starting_lba + end_adjust;
+    image->esp_size = image->esp_size_lbas * image->lba_size;
+    image->data_size_lbas = gpt_table[1].ending_lba - gpt_table[1].starting_lba + end_adjust;
+    image->data_size = image->data_size_lbas * image->lba_size;
+
+    return true;
+}
+
+// =============================
+// Hash an 8.3 name (FNV-1a)
+// =============================
+static uint32_t hash_short_name(const uint8_t *name) {
+    uint32_t hash = 2166136261u;
+    for (uint8_t i = 0; i < 11; i++) 
+        hash = (hash ^ name[i]) * 16777619u;
+    return hash;
+}
+
+// =============================
+// Create new empty in-memory directory index
+// =============================
+static Esp_Dir *esp_dir_new(const uint32_t cluster, const uint32_t next_entry) {
+    Esp_Dir *dir = calloc(1, sizeof *dir);
+    if (!dir) return NULL;
+
+    dir->cluster = cluster;
+    dir->last_cluster = cluster;
+    dir->next_entry = next_entry;
+    dir->num_buckets = 16;
+    dir->buckets = calloc(dir->num_buckets, sizeof *dir->buckets);
+    if (!dir->buckets) {
+        free(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+// =============================
+// Free directory index and all sub directory indexes
+// =============================
+static void esp_dir_free(Esp_Dir *dir) {
+    if (!dir) return;
+
+    for (uint32_t i = 0; i < dir->num_buckets; i++) {
+        Esp_Node *node = dir->buckets[i];
+        while (node) {
+            Esp_Node *next = node->next;
+            esp_dir_free(node->dir);
+            free(node);
+            node = next;
+        }
+    }
+    free(dir->buckets);
+    free(dir);
+}
+
+// =============================
+// Find an 8.3 name in a directory index, NULL if not found
+// =============================
+static Esp_Node *esp_dir_find(const Esp_Dir *dir, const char *name) {
+    Esp_Node *node = dir->buckets[hash_short_name((const uint8_t *)name) & (dir->num_buckets - 1)];
+    while (node && memcmp(node->name, name, 11)) 
+        node = node->next;
+    return node;
+}
+
+// =============================
+// Add an 8.3 name to a directory index, growing the hash table as needed
+// =============================
+static Esp_Node *esp_dir_insert(Esp_Dir *dir, const char *name, const uint32_t cluster, 
+                                const uint32_t entry, Esp_Dir *sub_dir) {
+    if (dir->num_nodes >= dir->num_buckets) {
+        // Rehash into twice as many buckets
+        const uint32_t num_buckets = dir->num_buckets * 2;
+        Esp_Node **buckets = calloc(num_buckets, sizeof *buckets);
+        if (!buckets) return NULL;
+
+        for (uint32_t i = 0; i < dir->num_buckets; i++) {
+            Esp_Node *node = dir->buckets[i];
+            while (node) {
+                Esp_Node *next = node->next;
+                const uint32_t idx = hash_short_name(node->name) & (num_buckets - 1);
+                node->next = buckets[idx];
+                buckets[idx] = node;
+                node = next;
+            }
+        }
+        free(dir->buckets);
+        dir->buckets = buckets;
+        dir->num_buckets = num_buckets;
+    }
+
+    Esp_Node *node = calloc(1, sizeof *node);
+    if (!node) return NULL;
+
+    memcpy(node->name, name, 11);
+    node->cluster = cluster;
+    node->entry = entry;
+    node->dir = sub_dir;
+
+    const uint32_t idx = hash_short_name(node->name) & (dir->num_buckets - 1);
+    node->next = dir->buckets[idx];
+    dir->buckets[idx] = node;
+    dir->num_nodes++;
+    return node;
+}
+
+// =====================================
+// Size FATs to hold an entry for every cluster that could fit in the ESP, rounded up
+//   so the data region starts on alignment value; returns lbas per FAT, and gets the
+//   # of clusters in the data region
+// =====================================
+static uint64_t fat32_fat_lbas(const Gpt_Image *image, uint64_t *data_region_clusters) {
+    const uint64_t lbas_per_cluster = image->cluster_size / image->lba_size;
+    const uint64_t max_clusters = image->esp_size_lbas / lbas_per_cluster;
+    const uint64_t min_fat_lbas = bytes_to_lbas(image, (max_clusters + 2) * sizeof *image->fat32_fat);
+    uint64_t meta_lbas = FAT32_RESERVED_SECTORS + (FAT32_NUM_FATS * min_fat_lbas);
+    meta_lbas += (image->align_lba - (meta_lbas % image->align_lba)) % image->align_lba;
+
+    *data_region_clusters = meta_lbas < image->esp_size_lbas ? 
+                            (image->esp_size_lbas - meta_lbas) / lbas_per_cluster : 0;
+    return (meta_lbas - FAT32_RESERVED_SECTORS) / FAT32_NUM_FATS;
+}
+
+// =====================================
+// Check the ESP & cluster size give a valid FAT32 cluster count, before any image
+//   file is created
+// =====================================
+static bool fat32_cluster_count_valid(const Gpt_Image *image) {
+    uint64_t data_region_clusters = 0;
+    fat32_fat_lbas(image, &data_region_clusters);
+
+    if (data_region_clusters < FAT32_MIN_CLUSTERS) {
+        fprintf(stderr, "Error: ESP has %"PRIu64" clusters of %"PRIu64" bytes; FAT32 needs at least %d. "
+                        "Use a larger ESP or smaller cluster size\n",
+                        data_region_clusters, image->cluster_size, FAT32_MIN_CLUSTERS);
+        return false;
+    }
+    if (data_region_clusters > FAT32_MAX_CLUSTERS) {
+        fprintf(stderr, "Error: ESP has %"PRIu64" clusters of %"PRIu64" bytes; FAT32 allows at most %d. "
+                        "Use a smaller ESP or larger cluster size\n",
+                        data_region_clusters, image->cluster_size, FAT32_MAX_CLUSTERS);
+        return false;
+    }
+    return true;
+}
+
+// =====================================
+// Write EFI System Partition (ESP) w/FAT32 filesystem
+// =====================================
+static bool write_esp(Gpt_Image *image) {
+    // Reserved sectors region --------------------------
+    // Fill out Volume Boot Record (VBR)
+    const uint8_t reserved_sectors = FAT32_RESERVED_SECTORS;
+    const uint8_t num_fats = FAT32_NUM_FATS;
+
+    image->fat32_lbas_per_cluster = image->cluster_size / image->lba_size;
+    uint64_t data_region_clusters = 0;
+    const uint64_t fat_lbas = fat32_fat_lbas(image, &data_region_clusters);
+
+    Vbr vbr = {
+        .BS_jmpBoot = { 0xEB, 0x00, 0x90 },
+        .BS_OEMName = { "THISDISK" },
+        .BPB_BytesPerSec = image->lba_size,     // This is limited to only 512/1024/2048/4096
+        .BPB_SecPerClus = image->fat32_lbas_per_cluster,
+        .BPB_RsvdSecCnt = reserved_sectors,
+        .BPB_NumFATs = num_fats,
+        .BPB_RootEntCnt = 0,
+        .BPB_TotSec16 = 0,
+        .BPB_Media = 0xF8,               // "Fixed" non-removable media; Could also be 0xF0 for e.g. flash drive
+        .BPB_FATSz16 = 0,
+        .BPB_SecPerTrk = 0,  
+        .BPB_NumHeads = 0,    
+        .BPB_HiddSec = image->esp_lba - 1,      // # of sectors before this partition/volume
+        .BPB_TotSec32 = image->esp_size_lbas,   // Size of this partition
+        .BPB_FATSz32 = fat_lbas,        // Data region starts on alignment value
+        .BPB_ExtFlags = 0,               // Mirrored FATs
+        .BPB_FSVer = 0,
+        .BPB_RootClus = 2,              // Clusters 0 & 1 are reserved; root dir cluster starts at 2
+        .BPB_FSInfo = 1,                // Sector 0 = this VBR; FS Info sector follows it
+        .BPB_BkBootSec = 6,
+        .BPB_Reserved = { 0 },
+        .BS_DrvNum = 0x80,              // 1st hard drive
+        .BS_Reserved1 = 0,
+        .BS_BootSig = 0x29,
+        .BS_VolID = { 0 }, 
+        .BS_VolLab = { "NO NAME    " }, // No volume label 
+        .BS_FilSysType = { "FAT32   " },
+
+        // Not in fatgen103.doc tables
+        .boot_code = { 0 },
+        .bootsect_sig = 0xAA55,     
+    };
+
+    // Fill out file system info sector
+    FSInfo fsinfo = {
+        .FSI_LeadSig = 0x41615252,
+        .FSI_Reserved1 = { 0 },
+        .FSI_StrucSig = 0x61417272,
+        .FSI_Free_Count = 0xFFFFFFFF,
+        .FSI_Nxt_Free = 5,              // First available cluster (value = 0) after /EFI/BOOT
+        .FSI_Reserved2 = { 0 },
+        .FSI_TrailSig = 0xAA550000,
+    };
+
+    image->fat32_fats_lba = image->esp_lba + vbr.BPB_RsvdSecCnt;
+    image->fat32_data_lba = image->fat32_fats_lba + (vbr.BPB_NumFATs * vbr.BPB_FATSz32);
+
+    // Write VBR and FSInfo sector
+    memcpy(image_lba(image, image->esp_lba), &vbr, sizeof vbr);
+    memcpy(image_lba(image, image->esp_lba + vbr.BPB_FSInfo), &fsinfo, sizeof fsinfo);
+
+    // Write VBR and FSInfo at backup location
+    memcpy(image_lba(image, image->esp_lba + vbr.BPB_BkBootSec), &vbr, sizeof vbr);
+    memcpy(image_lba(image, image->esp_lba + vbr.BPB_BkBootSec + vbr.BPB_FSInfo), &fsinfo, sizeof fsinfo);
+
+    // FAT region --------------------------
+    // Build FAT in memory, FATs in image are written when finalizing the ESP
+    //   (NOTE: FATs will be mirrored)
+    const uint64_t fat_entries = (vbr.BPB_FATSz32 * image->lba_size) / sizeof *image->fat32_fat;
+    image->fat32_num_clusters = (data_region_clusters + 2 < fat_entries) ? data_region_clusters + 2 : fat_entries;
+
+    image->fat32_fat = calloc(image->fat32_num_clusters, sizeof *image->fat32_fat);
+    if (!image->fat32_fat) {
+        fprintf(stderr, "Error: Could not allocate memory for FAT\n");
+        return false;
+    }
+
+    // Cluster 0; FAT identifier, lowest 8 bits are the media type/byte
+    image->fat32_fat[0] = 0xFFFFFF00 | vbr.BPB_Media;
+
+    // Cluster 1; End of Chain (EOC) marker
+    image->fat32_fat[1] = 0xFFFFFFFF;
+
+    // Cluster 2; Root dir '/' cluster start, if end of file/dir data then write EOC marker
+    image->fat32_fat[2] = 0xFFFFFFFF;
+
+    // Cluster 3; '/EFI' dir cluster
+    image->fat32_fat[3] = 0xFFFFFFFF;
+
+    // Cluster 4; '/EFI/BOOT' dir cluster
+    image->fat32_fat[4] = 0xFFFFFFFF;
+
+    // Cluster 5+; Other files/directories...
+    // e.g. if adding a file with a size = 5 sectors/clusters
+    //fat32_fat[5] = 6;    // Point to next cluster containing file data
+    //fat32_fat[6] = 7;    // Point to next cluster containing file data
+    //fat32_fat[7] = 8;    // Point to next cluster containing file data
+    //fat32_fat[8] = 9;    // Point to next cluster containing file data
+    //fat32_fat[9] = 0xFFFFFFFF; // EOC marker, no more file data after this cluster
+
+    image->fat32_next_free = fsinfo.FSI_Nxt_Free;
+    // Root, /EFI & /EFI/BOOT used
+    image->fat32_free_clusters = image->fat32_num_clusters - image->fat32_next_free;
+
+    // Data region --------------------------
+    // Write File/Dir data...
+    // Root '/' Directory entries
+    // "/EFI" dir entry 
+    FAT32_Dir_Entry_Short dir_ent = {
+        .DIR_Name = { "EFI        " },
+        .DIR_Attr = ATTR_DIRECTORY,
+        .DIR_NTRes = 0,
+        .DIR_CrtTimeTenth = 0,
+        .DIR_CrtTime = 0,
+        .DIR_CrtDate = 0,
+        .DIR_LstAccDate = 0,
+        .DIR_FstClusHI = 0,
+        .DIR_WrtTime = 0,
+        .DIR_WrtDate = 0,
+        .DIR_FstClusLO = 3,
+        .DIR_FileSize = 0,  // Directories have 0 file size
+    };
+
+    uint16_t create_time = 0, create_date = 0;
+    get_fat_dir_entry_time_date(&create_time, &create_date);
+
+    dir_ent.DIR_CrtTime = create_time;
+    dir_ent.DIR_CrtDate = create_date;
+    dir_ent.DIR_WrtTime = create_time;
+    dir_ent.DIR_WrtDate = create_date;
+
+    FAT32_Dir_Entry_Short *dir = image_lba(image, cluster_to_lba(image, 2));
+    dir[0] = dir_ent;
+
+    // /EFI Directory entries
+    dir = image_lba(image, cluster_to_lba(image, 3));
+
+    memcpy(dir_ent.DIR_Name, ".          ", 11);    // "." dir entry, this directory itself
+    dir[0] = dir_ent;
+
+    memcpy(dir_ent.DIR_Name, "..         ", 11);    // ".." dir entry, parent dir (ROOT dir)
+    dir_ent.DIR_FstClusLO = 0;                      // Root directory does not have a cluster value
+    dir[1] = dir_ent;
+
+    memcpy(dir_ent.DIR_Name, "BOOT       ", 11);    // /EFI/BOOT directory
+    dir_ent.DIR_FstClusLO = 4;                      // /EFI/BOOT cluster
+    dir[2] = dir_ent;
+
+    // /EFI/BOOT Directory entries
+    dir = image_lba(image, cluster_to_lba(image, 4));
+
+    memcpy(dir_ent.DIR_Name, ".          ", 11);    // "." dir entry, this directory itself
+    dir[0] = dir_ent;
+
+    memcpy(dir_ent.DIR_Name, "..         ", 11);    // ".." dir entry, parent dir (/EFI dir)
+    dir_ent.DIR_FstClusLO = 3;                      // /EFI directory cluster
+    dir[1] = dir_ent;
+
+    // Index directories above for path lookups; next free entry in each directory
+    //   is after the entries written above
+    Esp_Dir *efi_dir = esp_dir_new(3, 3), *boot_dir = esp_dir_new(4, 2);
+    image->esp_root_dir = esp_dir_new(2, 1);
+    if (!image->esp_root_dir || !efi_dir || !boot_dir ||
+        !esp_dir_insert(image->esp_root_dir, "EFI        ", 3, 0, efi_dir) ||
+        !esp_dir_insert(efi_dir, "BOOT       ", 4, 2, boot_dir)) {
+        fprintf(stderr, "Error: Could not allocate memory for ESP directory index\n");
+        return false;
+    }
+
+    return true;
+}
+
+// =============================
+// Link a run of clusters into a chain in the in-memory FAT
+// =============================
+static void fat32_link_chain(Gpt_Image *image, const uint32_t starting_cluster, const uint64_t num_clusters) {
+    // Each cluster points to next cluster of file data, last cluster gets EOC marker
+    const uint32_t last_cluster = starting_cluster + num_clusters - 1;
+    for (uint32_t cluster = starting_cluster; cluster <= last_cluster; cluster++) {
+        if (image->fat32_fat[cluster] == 0) image->fat32_free_clusters--;
+        image->fat32_fat[cluster] = cluster + 1;
+    }
+    image->fat32_fat[last_cluster] = 0xFFFFFFFF;
+}
+
+// =============================
+// Get first free cluster a new file's data can start at, on the ESP file alignment
+//   from start of disk; skipped clusters are left free
+// =============================
+static uint32_t fat32_file_start(const Gpt_Image *image) {
+    uint32_t cluster = image->fat32_next_free;
+    while (cluster < image->fat32_num_clusters &&
+           (cluster_to_lba(image, cluster) * image->lba_size) % image->esp_align != 0)
+        cluster++;
+    return cluster;
+}
+
+// =============================
+// Allocate a new cluster chain of a given length in the in-memory FAT, as 1 contiguous run
+//   after all clusters in use; file data starts on the ESP file alignment.
+//   Directory clusters are zeroed, so entries after the last one read as end of directory.
+//   Returns starting cluster of chain, or 0 if there is no room left in the ESP
+// =============================
+static uint32_t fat32_alloc_chain(Gpt_Image *image, const uint64_t num_clusters, const bool file_data) {
+    const uint32_t starting_cluster = file_data ? fat32_file_start(image) : image->fat32_next_free;
+    if (num_clusters == 0 || num_clusters > image->fat32_num_clusters - starting_cluster)
+        return 0;
+
+    if (!file_data) 
+        image_zero_lbas(image, cluster_to_lba(image, starting_cluster), 
+                        num_clusters * image->fat32_lbas_per_cluster);
+
+    fat32_link_chain(image, starting_cluster, num_clusters);
+    image->fat32_next_free = starting_cluster + num_clusters;
+    return starting_cluster;
+}
+
+// =============================
+// Get next cluster in a chain from the in-memory FAT; 0 at end of chain or if invalid
+// =============================
+static uint32_t fat32_next_cluster(const Gpt_Image *image, const uint32_t cluster) {
+    const uint32_t next = image->fat32_fat[cluster] & 0x0FFFFFFF;
+    if (next < 2 || next >= image->fat32_num_clusters) return 0;
+    return next;
+}
+
+// =============================
+// Get # of clusters in a chain, and if the chain is a single contiguous run of clusters
+// =============================
+static uint64_t fat32_chain_length(const Gpt_Image *image, uint32_t cluster, bool *contiguous) {
+    uint64_t num_clusters = 0;
+    *contiguous = true;
+
+    while (cluster >= 2 && cluster < image->fat32_num_clusters && num_clusters < image->fat32_num_clusters) {
+        const uint32_t next = fat32_next_cluster(image, cluster);
+        if (next && next != cluster + 1) *contiguous = false;
+
+        num_clusters++;
+        cluster = next;
+    }
+    return num_clusters;
+}
+
+// =============================
+// Free a cluster chain in the in-memory FAT, and clear its data in the image so no
+//   old file data is left in free clusters; runs of consecutive clusters (as chains
+//   are allocated) are cleared with 1 call each
+// =============================
+static void fat32_free_chain(Gpt_Image *image, uint32_t cluster) {
+    uint32_t run_start = 0, run_length = 0;
+    while (cluster >= 2 && cluster < image->fat32_num_clusters && image->fat32_fat[cluster] != 0) {
+        const uint32_t next = fat32_next_cluster(image, cluster);
+        if (run_length > 0 && cluster != run_start + run_length) {
+            image_zero_lbas(image, cluster_to_lba(image, run_start), 
+                            (uint64_t)run_length * image->fat32_lbas_per_cluster);
+            run_length = 0;
+        }
+        if (run_length == 0) run_start = cluster;
+        run_length++;
+
+        image->fat32_fat[cluster] = 0;
+        image->fat32_free_clusters++;
+        cluster = next;
+    }
+
+    if (run_length > 0)
+        image_zero_lbas(image, cluster_to_lba(image, run_start), 
+                        (uint64_t)run_length * image->fat32_lbas_per_cluster);
+}
+
+// =============================
+// Get a printable "NAME.EXT" from an 8.3 short name
+// =============================
+static void short_name_to_str(const uint8_t *short_name, char *str) {
+    char *p = str;
+    for (uint8_t i = 0; i < 8 && short_name[i] != ' '; i++) *p++ = short_name[i];
+    if (short_name[8] != ' ') *p++ = '.';
+    for (uint8_t i = 8; i < 11 && short_name[i] != ' '; i++) *p++ = short_name[i];
+    *p = '\0';
+}
+
+// =============================
+// Read an existing directory & all of its sub directories into an in-memory index;
+//   path is the directory's path for errors, "" for the root directory
+// =============================
+static Esp_Dir *read_esp_dir(const Gpt_Image *image, const uint32_t cluster, const char *path, 
+                             const uint32_t depth) {
+    if (depth > 64) {
+        fprintf(stderr, "Error: ESP directory '%s/' is nested too deep, directories may loop\n", path);
+        return NULL;
+    }
+    if (cluster < 2 || cluster >= image->fat32_num_clusters || image->fat32_fat[cluster] == 0) {
+        fprintf(stderr, "Error: ESP directory '%s/' starts at invalid or free cluster %"PRIu32"\n", 
+                path, cluster);
+        return NULL;
+    }
+
+    Esp_Dir *dir = esp_dir_new(cluster, 0);
+    if (!dir) {
+        fprintf(stderr, "Error: Could not allocate memory for ESP directory '%s/'\n", path);
+        return NULL;
+    }
+
+    const uint32_t entries_per_cluster = image->cluster_size / sizeof(FAT32_Dir_Entry_Short);
+    uint32_t entry = 0;
+
+    for (uint32_t current = cluster; current; current = fat32_next_cluster(image, current)) {
+        dir->last_cluster = current;
+        if (entry >= FAT32_MAX_DIR_ENTRIES) break;  // Invalid or looping chain
+
+        const FAT32_Dir_Entry_Short *entries = image_lba(image, cluster_to_lba(image, current));
+        for (uint32_t i = 0; i < entries_per_cluster; i++, entry++) {
+            const FAT32_Dir_Entry_Short *dir_entry = &entries[i];
+            if (dir_entry->DIR_Name[0] == 0x00) {
+                // No more entries in directory
+                dir->next_entry = entry;
+                return dir;
+            }
+
+            // Skip deleted entries, long names, volume label, "." & ".."
+            if (dir_entry->DIR_Name[0] == 0xE5 || dir_entry->DIR_Name[0] == '.' ||
+                (dir_entry->DIR_Attr & ATTR_VOLUME_ID)) 
+                continue;
+
+            char name[13], entry_path[1024];
+            short_name_to_str(dir_entry->DIR_Name, name);
+            snprintf(entry_path, sizeof entry_path, "%s/%s", path, name);
+
+            const uint32_t first_cluster = (dir_entry->DIR_FstClusHI << 16) | dir_entry->DIR_FstClusLO;
+            Esp_Dir *sub_dir = NULL;
+            if (dir_entry->DIR_Attr & ATTR_DIRECTORY) {
+                if (first_cluster < 2 || first_cluster >= image->fat32_num_clusters || 
+                    image->fat32_fat[first_cluster] == 0) {
+                    fprintf(stderr, "Error: ESP directory '%s/' (entry %"PRIu32" of '%s/', in cluster %"PRIu32") "
+                                    "starts at invalid or free cluster %"PRIu32"\n", 
+                            entry_path, entry, path, current, first_cluster);
+                    esp_dir_free(dir);
+                    return NULL;
+                }
+
+                sub_dir = read_esp_dir(image, first_cluster, entry_path, depth + 1);
+                if (!sub_dir) {
+                    esp_dir_free(dir);
+                    return NULL;
+                }
+            }
+
+            if (!esp_dir_insert(dir, (const char *)dir_entry->DIR_Name, first_cluster, entry, sub_dir)) {
+                fprintf(stderr, "Error: Could not allocate memory for ESP directory entry '%s'\n", entry_path);
+                esp_dir_free(sub_dir);
+                esp_dir_free(dir);
+                return NULL;
+            }
+        }
+    }
+
+    // Directory's clusters are full of entries
+    dir->next_entry = entry;
+    return dir;
+}
+
+// =============================
+// Read & check FAT32 filesystem of an existing ESP; loads its FAT into memory
+//   and indexes all of its directories, to add or update files
+// =============================
+static bool read_esp(Gpt_Image *image) {
+    const Vbr *vbr = image_lba(image, image->esp_lba);
+
+    if (vbr->bootsect_sig != 0xAA55 ||
+        vbr->BPB_BytesPerSec != image->lba_size ||
+        vbr->BPB_SecPerClus == 0 ||
+        (vbr->BPB_SecPerClus & (vbr->BPB_SecPerClus - 1)) ||
+        vbr->BPB_NumFATs == 0 ||
+        vbr->BPB_RootClus != 2 ||
+        memcmp(vbr->BS_FilSysType, "FAT32   ", 8) ||
+        vbr->BPB_TotSec32 > image->esp_size_lbas ||
+        vbr->BPB_RsvdSecCnt + ((uint64_t)vbr->BPB_NumFATs * vbr->BPB_FATSz32) >= vbr->BPB_TotSec32) {
+        fprintf(stderr, "Error: ESP does not have a valid FAT32 filesystem\n");
+        return false;
+    }
+
+    image->fat32_lbas_per_cluster = vbr->BPB_SecPerClus;
+    image->cluster_size = image->fat32_lbas_per_cluster * image->lba_size;
+    if (!image->esp_align) image->esp_align = image->cluster_size;
+    image->fat32_fats_lba = image->esp_lba + vbr->BPB_RsvdSecCnt;
+    image->fat32_data_lba = image->fat32_fats_lba + (vbr->BPB_NumFATs * vbr->BPB_FATSz32);
+
+    const uint64_t data_region_clusters = (vbr->BPB_TotSec32 - (image->fat32_data_lba - image->esp_lba)) /
+                                          vbr->BPB_SecPerClus;
+    const uint64_t fat_entries = ((uint64_t)vbr->BPB_FATSz32 * image->lba_size) / sizeof *image->fat32_fat;
+    image->fat32_num_clusters = (data_region_clusters + 2 < fat_entries) ? data_region_clusters + 2 : fat_entries;
+
+    // Load 1st FAT; new clusters are allocated after the last cluster in use
+    image->fat32_fat = malloc(image->fat32_num_clusters * sizeof *image->fat32_fat);
+    if (!image->fat32_fat) {
+        fprintf(stderr, "Error: Could not allocate memory for FAT\n");
+        return false;
+    }
+    memcpy(image->fat32_fat, image_lba(image, image->fat32_fats_lba),
+           image->fat32_num_clusters * sizeof *image->fat32_fat);
+
+    image->fat32_next_free = image->fat32_num_clusters;
+    while (image->fat32_next_free > 3 && image->fat32_fat[image->fat32_next_free - 1] == 0) 
+        image->fat32_next_free--;
+
+    // Count free clusters once, then keep count as chains are allocated & freed
+    image->fat32_free_clusters = 0;
+    for (uint32_t cluster = 2; cluster < image->fat32_num_clusters; cluster++)
+        if (image->fat32_fat[cluster] == 0) image->fat32_free_clusters++;
+
+    image->esp_root_dir = read_esp_dir(image, vbr->BPB_RootClus, "", 0);
+    if (!image->esp_root_dir) {
+        fprintf(stderr, "Error: Could not read ESP directories\n");
+        return false;
+    }
+
+    return true;
+}
+
+// =============================
+// Get a directory's dir entry in the image by index, following its cluster chain
+// =============================
+static FAT32_Dir_Entry_Short *esp_dir_entry(const Gpt_Image *image, const Esp_Dir *dir, const uint32_t entry) {
+    const uint32_t entries_per_cluster = image->cluster_size / sizeof(FAT32_Dir_Entry_Short);
+
+    uint32_t cluster = dir->cluster;
+    for (uint32_t i = 0; i < entry / entries_per_cluster && cluster; i++)
+        cluster = fat32_next_cluster(image, cluster);
+    if (!cluster) return NULL;
+
+    FAT32_Dir_Entry_Short *entries = image_lba(image, cluster_to_lba(image, cluster));
+    return &entries[entry % entries_per_cluster];
+}
+
+// =============================
+// Read an ESP file's data by following its cluster chain; copies data to buf and/or
+//   gets its CRC32 in crc, if not NULL
+// =============================
+static bool esp_read_file(const Gpt_Image *image, uint32_t cluster, const uint64_t size, 
+                          uint8_t *buf, uint32_t *crc) {
+    if (crc) *crc = 0;
+    for (uint64_t offset = 0; offset < size; offset += image->cluster_size) {
+        if (cluster < 2 || cluster >= image->fat32_num_clusters) return false;
+
+        const uint64_t len = (size - offset < image->cluster_size) ? size - offset : image->cluster_size;
+        const uint8_t *data = image_lba(image, cluster_to_lba(image, cluster));
+        if (buf) memcpy(buf + offset, data, len);
+        if (crc) *crc = crc32_update(*crc, data, len);
+
+        cluster = fat32_next_cluster(image, cluster);
+    }
+    return true;
+}
+
+// =============================
+// Check if an ESP file's data is the same as a local file, or as data already streamed
+//   into the image at stream_lba (if not 0); compared cluster by cluster along its chain
+// =============================
+static bool esp_file_equals(const Gpt_Image *image, uint32_t cluster, const uint64_t size, 
+                            const char *filepath, const uint64_t stream_lba) {
+    FILE *fp = NULL;
+    uint8_t *chunk = NULL;
+    if (!stream_lba) {
+        fp = fopen(filepath, "rb");
+        chunk = malloc(image->cluster_size);
+        if (!fp || !chunk) {
+            if (fp) fclose(fp);
+            free(chunk);
+            return false;
+        }
+    }
+
+    bool result = true;
+    for (uint64_t offset = 0; result && offset < size; offset += image->cluster_size) {
+        if (cluster < 2 || cluster >= image->fat32_num_clusters) {
+            result = false;
+            break;
+        }
+
+        const uint64_t len = (size - offset < image->cluster_size) ? size - offset : image->cluster_size;
+        const uint8_t *data = image_lba(image, cluster_to_lba(image, cluster));
+        if (stream_lba) {
+            const uint8_t *streamed = image_lba(image, stream_lba);
+            result = !memcmp(data, streamed + offset, len);
+        } else {
+            result = fread(chunk, 1, len, fp) == len && !memcmp(chunk, data, len);
+        }
+
+        cluster = fat32_next_cluster(image, cluster);
+    }
+
+    free(chunk);
+    if (fp) fclose(fp);
+    return result;
+}
+
+// =============================
+// Write in-memory FAT to each FAT copy in the image and update FS Info
+// =============================
+static bool finalize_esp(Gpt_Image *image) {
+    const Vbr *vbr = image_lba(image, image->esp_lba);
+    FSInfo *fsinfo = image_lba(image, image->esp_lba + vbr->BPB_FSInfo);
+
+    // Only the used start of the FAT needs writing, the rest of the FAT is 0s (free);
+    //   only write FAT sectors that changed, when updating an existing image
+    const uint64_t used_size = image->fat32_next_free * sizeof *image->fat32_fat;
+    for (uint8_t i = 0; i < vbr->BPB_NumFATs; i++) {
+        uint8_t *fat = image_lba(image, image->fat32_fats_lba + (i * vbr->BPB_FATSz32));
+        for (uint64_t offset = 0; offset < used_size; offset += image->lba_size) {
+            const uint64_t len = (used_size - offset < image->lba_size) ? used_size - offset : image->lba_size;
+            if (memcmp(fat + offset, (uint8_t *)image->fat32_fat + offset, len))
+                memcpy(fat + offset, (uint8_t *)image->fat32_fat + offset, len);
+        }
+    }
+
+    // Set exact free cluster count & next free cluster in FS Info, so FAT drivers don't
+    //   have to scan the whole FAT on first mount; 0xFFFFFFFF = no free clusters left
+    const uint32_t next_free = image->fat32_next_free < image->fat32_num_clusters ?
+                               image->fat32_next_free : 0xFFFFFFFF;
+    if (fsinfo->FSI_Free_Count != image->fat32_free_clusters)
+        fsinfo->FSI_Free_Count = image->fat32_free_clusters;
+    if (fsinfo->FSI_Nxt_Free != next_free)
+        fsinfo->FSI_Nxt_Free = next_free;
+
+    // Keep backup VBR & FS Info the same as the primary; older versions wrote the backup 
+    //   VBR over the primary VBR, this also fixes it when updating
+    if (vbr->BPB_BkBootSec != 0) {
+        Vbr *backup_vbr = image_lba(image, image->esp_lba + vbr->BPB_BkBootSec);
+        if (memcmp(backup_vbr, vbr, sizeof *vbr))
+            memcpy(backup_vbr, vbr, sizeof *vbr);
+
+        FSInfo *backup_fsinfo = image_lba(image, image->esp_lba + vbr->BPB_BkBootSec + vbr->BPB_FSInfo);
+        if (memcmp(backup_fsinfo, fsinfo, sizeof *fsinfo))
+            memcpy(backup_fsinfo, fsinfo, sizeof *fsinfo);
+    }
+
+    free(image->fat32_fat);
+    image->fat32_fat = NULL;
+    esp_dir_free(image->esp_root_dir);
+    image->esp_root_dir = NULL;
+    return true;
+}
+
+// =============================
+// Copy a stream's data into the free clusters at the end of the ESP, before a cluster
+//   chain is allocated for it there; size is the expected size or UINT64_MAX if not 
+//   known, and gets the actual size
+// =============================
+static bool stream_to_esp(FILE *stream, const char *filepath, Gpt_Image *image, uint64_t *size, uint32_t *crc) {
+    const uint64_t expected_size = *size;
+    const uint32_t start = fat32_file_start(image);
+    const uint64_t lba = cluster_to_lba(image, start);
+
+    uint64_t max_size = (uint64_t)(image->fat32_num_clusters - start) * image->cluster_size;
+    if (max_size > UINT32_MAX) max_size = UINT32_MAX;   // Max FAT32 file size
+    if (max_size > expected_size) max_size = expected_size;
+
+    bool result = copy_stream_to_image(stream, image, lba, max_size, size, crc);
+    if (!result) {
+        fprintf(stderr, "Error: Could not read '%s', or it does not fit in the ESP\n", filepath);
+    } else if (expected_size != UINT64_MAX && *size != expected_size) {
+        fprintf(stderr, "Error: '%s' has %"PRIu64" bytes, expected %"PRIu64"\n", 
+                filepath, *size, expected_size);
+        result = false;
+    }
+
+    // Don't leave partial data in free clusters, new files are only written where not 0
+    if (!result) image_zero_lbas(image, lba, bytes_to_lbas(image, *size));
+    return result;
+}
+
+// =============================
+// Add a new directory or file to a given parent directory; a file's data is
+//   planned to be copied from local file filepath of size file_size_bytes, or is
+//   copied now from stream if not NULL
+// =============================
+static bool add_file_to_esp(char *file_name, const char *filepath, FILE *stream, uint64_t file_size_bytes,
+                            Gpt_Image *image, File_Type type, Esp_Dir **parent_dir) {
+
+    // New directory entry goes in next free spot at end of parent dir's current dir_entrys;
+    //   when the directory's last cluster is full, extend its chain by another cluster
+    Esp_Dir *dir = *parent_dir;
+    const uint32_t entries_per_cluster = image->cluster_size / sizeof(FAT32_Dir_Entry_Short);
+    if (dir->next_entry == FAT32_MAX_DIR_ENTRIES) {
+        fprintf(stderr, "Error: No room for new directory entry '%.11s'\n", file_name);
+        return false;
+    }
+
+    if (dir->next_entry > 0 && dir->next_entry % entries_per_cluster == 0) {
+        const uint32_t new_cluster = fat32_alloc_chain(image, 1, false);
+        if (new_cluster == 0) {
+            fprintf(stderr, "Error: No room left in ESP for '%.11s'\n", file_name);
+            return false;
+        }
+        image->fat32_fat[dir->last_cluster] = new_cluster;
+        dir->last_cluster = new_cluster;
+    }
+
+    // A stream's size is only known once it is read, into the clusters allocated next
+    uint32_t stream_crc32 = 0;
+    if (type == TYPE_FILE && stream && 
+        !stream_to_esp(stream, filepath, image, &file_size_bytes, &stream_crc32))
+        return false;
+
+    const uint64_t file_size_clusters = (type == TYPE_FILE) ? bytes_to_clusters(image, file_size_bytes) : 0;
+
+    // Add new cluster chain to FAT, a directory or empty file gets a single cluster
+    const uint32_t starting_cluster = file_size_clusters > 0 ? fat32_alloc_chain(image, file_size_clusters, true)
+                                                             : fat32_alloc_chain(image, 1, false);
+    if (starting_cluster == 0) {
+        fprintf(stderr, "Error: No room left in ESP for '%.11s'\n", file_name);
+        return false;
+    }
+
+    // Add new directory entry for this new dir/file in parent directory's data
+    FAT32_Dir_Entry_Short dir_entry = { 0 };
+
+    // Set 8.3 file name
+    memcpy(dir_entry.DIR_Name, file_name, 11);
+
+    if (type == TYPE_DIR) dir_entry.DIR_Attr = ATTR_DIRECTORY;
+
+    uint16_t fat_time, fat_date;
+    get_fat_dir_entry_time_date(&fat_time, &fat_date);
+    dir_entry.DIR_CrtTime = fat_time;
+    dir_entry.DIR_CrtDate = fat_date;
+    dir_entry.DIR_WrtTime = fat_time;
+    dir_entry.DIR_WrtDate = fat_date;
+
+    dir_entry.DIR_FstClusHI = (starting_cluster >> 16) & 0xFFFF;
+    dir_entry.DIR_FstClusLO = starting_cluster & 0xFFFF;
+
+    if (type == TYPE_FILE)
+        dir_entry.DIR_FileSize = file_size_bytes;
+
+    FAT32_Dir_Entry_Short *parent_entries = image_lba(image, cluster_to_lba(image, dir->last_cluster));
+    parent_entries[dir->next_entry++ % entries_per_cluster] = dir_entry;
+
+    // Add to parent's index, with a new index if this is a directory
+    Esp_Dir *new_dir_index = NULL;
+    if (type == TYPE_DIR) new_dir_index = esp_dir_new(starting_cluster, 2);  // After "." & ".."
+    if ((type == TYPE_DIR && !new_dir_index) ||
+        !esp_dir_insert(dir, file_name, starting_cluster, dir->next_entry - 1, new_dir_index)) {
+        fprintf(stderr, "Error: Could not allocate memory for ESP directory index\n");
+        esp_dir_free(new_dir_index);
+        return false;
+    }
+
+    // Add new file data at this new file's cluster's data location in data region
+    // For directory add dir_entrys for "." and ".."
+    if (type == TYPE_DIR) {
+        FAT32_Dir_Entry_Short *new_dir = image_lba(image, cluster_to_lba(image, starting_cluster));
+
+        memcpy(dir_entry.DIR_Name, ".          ", 11);  // "." dir_entry; this directory itself
+        new_dir[0] = dir_entry;
+
+        // ".." dir_entry; parent directory, root directory does not have a cluster value
+        const uint32_t parent_cluster = (dir->cluster == 2) ? 0 : dir->cluster;
+        memcpy(dir_entry.DIR_Name, "..         ", 11);
+        dir_entry.DIR_FstClusHI = (parent_cluster >> 16) & 0xFFFF;
+        dir_entry.DIR_FstClusLO = parent_cluster & 0xFFFF;
+        new_dir[1] = dir_entry;
+    } else if (!stream) {
+        // For file, plan copy of file data into its clusters
+        if (!queue_copy_job(image, filepath, cluster_to_lba(image, starting_cluster), file_size_bytes, -1)) {
+            fprintf(stderr, "Error: Could not allocate memory for file copy '%s'\n", filepath);
+            return false;
+        }
+    }
+
+    // Set new parent dir, if a directory was just added
+    if (type == TYPE_DIR)
+        *parent_dir = new_dir_index;
+
+    return true;
+}
+
+// =============================
+// Update a file already in the ESP from a local file or stream; compares size, CRC32
+//   and then bytes of the data already in the image with the new data, and only rewrites
+//   the file's clusters & dir entry if they differ
+// =============================
+static bool update_esp_file(Gpt_Image *image, const Esp_Dir *dir, Esp_Node *node, const char *filepath, 
+                            FILE *stream, uint64_t file_size_bytes, bool *changed) {
+    *changed = false;
+    FAT32_Dir_Entry_Short *dir_entry = esp_dir_entry(image, dir, node->entry);
+    if (!dir_entry) return false;
+
+    // A stream can only be read once, read it into free clusters to compare it
+    uint32_t old_crc32 = 0, new_crc32 = 0;
+    if (stream && !stream_to_esp(stream, filepath, image, &file_size_bytes, &new_crc32))
+        return false;
+    const uint64_t new_clusters = file_size_bytes > 0 ? bytes_to_clusters(image, file_size_bytes) : 1;
+    const uint64_t stream_lba = stream ? cluster_to_lba(image, fat32_file_start(image)) : 0;
+
+    if (dir_entry->DIR_FileSize == file_size_bytes) {
+        if (!stream && !file_crc32(filepath, &new_crc32)) {
+            fprintf(stderr, "Error: Could not read file '%s'\n", filepath);
+            return false;
+        }
+        if (esp_read_file(image, node->cluster, file_size_bytes, NULL, &old_crc32) &&
+            old_crc32 == new_crc32 &&
+            esp_file_equals(image, node->cluster, file_size_bytes, filepath, stream_lba)) {
+            // Same data, nothing to do; clear streamed copy from free clusters
+            if (stream)
+                image_zero_lbas(image, stream_lba, new_clusters * image->fat32_lbas_per_cluster);
+            return true;
+        }
+    }
+    *changed = true;
+
+    // Streamed data is already in the free clusters a new chain gets. Otherwise reuse
+    //   file's clusters if they are 1 contiguous run big enough for the new data, or
+    //   move the file to a new cluster chain
+    bool contiguous = false;
+    const uint64_t old_clusters = stream ? 0 : fat32_chain_length(image, node->cluster, &contiguous);
+
+    uint32_t starting_cluster = 0;
+    if (contiguous && old_clusters >= new_clusters &&
+        (cluster_to_lba(image, node->cluster) * image->lba_size) % image->esp_align == 0) {
+        fat32_free_chain(image, node->cluster);
+        starting_cluster = node->cluster;
+        fat32_link_chain(image, starting_cluster, new_clusters);
+    } else {
+        starting_cluster = fat32_alloc_chain(image, new_clusters, true);
+        if (starting_cluster == 0) {
+            fprintf(stderr, "Error: No room left in ESP for '%.11s'\n", node->name);
+            return false;
+        }
+        fat32_free_chain(image, node->cluster);
+    }
+
+    // Clear old data, then plan copy of new data into file's clusters
+    if (!stream) 
+        image_zero_lbas(image, cluster_to_lba(image, starting_cluster),
+                        new_clusters * image->fat32_lbas_per_cluster);
+    if (!stream && !queue_copy_job(image, filepath, cluster_to_lba(image, starting_cluster), file_size_bytes, -1)) {
+        fprintf(stderr, "Error: Could not allocate memory for file copy '%s'\n", filepath);
+        return false;
+    }
+
+    uint16_t fat_time, fat_date;
+    get_fat_dir_entry_time_date(&fat_time, &fat_date);
+    dir_entry->DIR_WrtTime = fat_time;
+    dir_entry->DIR_WrtDate = fat_date;
+    dir_entry->DIR_FstClusHI = (starting_cluster >> 16) & 0xFFFF;
+    dir_entry->DIR_FstClusLO = starting_cluster & 0xFFFF;
+    dir_entry->DIR_FileSize = file_size_bytes;
+    node->cluster = starting_cluster;
+
+    return true;
+}
+
+// =============================
+// Add a file path to the EFI System Partition;
+//   will add new directories if not found, and
+//   new file at end of path, with data from local file filepath of size file_size_bytes,
+//   or from stream if not NULL
+// =============================
+static bool add_input_to_esp(char *path, const char *filepath, FILE *stream, const uint64_t file_size_bytes,
+                             Gpt_Image *image) {
+    // Parse input path for each name
+    if (*path != '/') return false; // Path must begin with root '/'
+
+    // FAT32 file sizes are 32 bits; streams are checked as they are read
+    if (!stream && file_size_bytes > UINT32_MAX) {
+        fprintf(stderr, "Error: '%s' is %"PRIu64" bytes, FAT32 files can be at most %"PRIu32" bytes; "
+                        "add it to the data partition instead\n", filepath, file_size_bytes, UINT32_MAX);
+        return false;
+    }
+
+    // Uppercase path for that smooth DOS feel, but probably doesn't matter for any modern UEFI
+    //   or FAT implementations
+    for (size_t i = 0; i < strlen(path); i++) 
+        path[i] = toupper(path[i]);
+
+    File_Type type = TYPE_DIR;
+    char *start = path + 1; // Skip initial slash
+    char *end = start;
+    Esp_Dir *dir = image->esp_root_dir;    // Next directory to look in; start at root
+    bool any_files_added = false, file_updated = false;
+
+    // Get next name from path, until reached end of path for file to add
+    while (type == TYPE_DIR) {
+        while (*end != '/' && *end != '\0') end++;
+
+        if (*end == '/') type = TYPE_DIR;
+        else             type = TYPE_FILE;  // Reached end of path
+
+        *end = '\0';    // Null terminate next name in case of directory
+
+        char *dot_pos = strchr(start, '.');
+        if ((type == TYPE_DIR  && strlen(start) > 11) ||
+            (type == TYPE_FILE && strlen(start) > 12) || 
+            (dot_pos && dot_pos - start > 8)) {
+            return false;   // Name is too long or invalid 8.3 naming
+        }
+
+        // Convert file name to 8.3 name before checking if exists
+        // e.g. "FOO.BAR"  -> "FOO     BAR" 
+        //      "BA.Z"     -> "BA      Z  " 
+        //      "ELEPHANT" -> "ELEPHANT   "
+        char short_name[12] = {0};
+        memset(short_name, ' ', 11);
+        if (type == TYPE_DIR || !dot_pos)  {
+            memcpy(short_name, start, strlen(start));  // No '.', copy full name
+        } else {
+            memcpy(short_name, start, dot_pos - start); // Name 8 in 8.3
+            strncpy(&short_name[8], dot_pos+1, 3);      // Extension 3 in 8.3
+        }
+
+        // Search for name in current directory's index
+        Esp_Node *node = esp_dir_find(dir, short_name);
+        if (node && type == TYPE_DIR) {
+            // Found name in directory, use it as next directory to look in
+            if (!node->dir) {
+                fprintf(stderr, "Error: '%s' in path is a file, not a directory\n", start);
+                return false;
+            }
+            dir = node->dir;
+        } else if (node && image->update_image) {
+            // Updating an existing image, rewrite file if local file is different
+            if (node->dir) {
+                fprintf(stderr, "Error: '%s' in path is a directory, not a file\n", start);
+                return false;
+            }
+            if (!update_esp_file(image, dir, node, filepath, stream, file_size_bytes, &file_updated))
+                return false;
+        } else if (!node) {
+            // Add new directory or file to last found directory;
+            //   if new directory, update current directory to check/use
+            //   for next new files 
+            if (!add_file_to_esp(short_name, filepath, stream, file_size_bytes, image, type, &dir))
+                return false;
+
+            any_files_added = true;
+        }
+
+        *end++ = '/';
+        start = end;
+    }
+
+    *--end = '\0';  // Don't add extra slash to end of path, final file name is not a directory
+
+    // Show info to user
+    if (image->config.quiet) return true;
+    if (any_files_added) printf("Added '%s' to EFI System Partition\n", path);
+    if (file_updated)    printf("Updated '%s' in EFI System Partition\n", path);
+
+    return true;
+}
+
+// =============================
+// Add a file path to the EFI System Partition, with data from local file, pipe or 
+//   stdin ("-:NAME[:SIZE]") filepath
+// =============================
+static bool add_path_to_esp(char *path, const char *filepath, Gpt_Image *image) {
+    FILE *stream = NULL;
+    uint64_t file_size_bytes = 0;
+    if (!open_input(filepath, &stream, &file_size_bytes)) return false;
+
+    const bool result = add_input_to_esp(path, filepath, stream, file_size_bytes, image);
+    close_input(stream);
+    return result;
+}
+
+// =============================
+// Add a file path to the EFI System Partition, with data from an in-memory buffer;
+//   the data is copied straight into the file's clusters, as for a stream
+// =============================
+static bool add_buffer_to_esp(char *path, const char *name, const void *buf, const size_t size, 
+                              Gpt_Image *image) {
+#ifdef _WIN32
+    // No fmemopen(), read the buffer back from a temporary file instead
+    FILE *stream = tmpfile();
+    if (stream && (fwrite(buf, 1, size, stream) != size || fseek(stream, 0, SEEK_SET) != 0)) {
+        fclose(stream);
+        stream = NULL;
+    }
+#else
+    FILE *stream = fmemopen((void *)buf, size, "rb");
+#endif
+    if (!stream) {
+        fprintf(stderr, "Error: Could not open in-memory file '%s'\n", name);
+        return false;
+    }
+
+    const bool result = add_input_to_esp(path, name, stream, size, image);
+    fclose(stream);
+    return result;
+}
+
+// =============================
+// Add a local file to a directory path in the EFI System Partition,
+//   e.g. "/EFI/BOOT/" + "build/FOO.EFI" adds "/EFI/BOOT/FOO.EFI",
+//   "/EFI/BOOT/" + "-:FOO.EFI" adds "/EFI/BOOT/FOO.EFI" from stdin
+// =============================
+static bool add_local_file_to_esp(const char *dir_path, const char *filepath, Gpt_Image *image) {
+    const char *slash = strrchr(filepath, '/');
+    const char *name = slash ? slash + 1 : filepath;
+
+    char stdin_name[256];
+    uint64_t stdin_size = 0;
+    if (parse_stdin_arg(filepath, stdin_name, sizeof stdin_name, &stdin_size))
+        name = stdin_name;
+
+    char *path = malloc(strlen(dir_path) + strlen(name) + 1);
+    if (!path) return false;
+    strcpy(path, dir_path);
+    strcat(path, name);
+
+    const bool result = add_path_to_esp(path, filepath, image);
+    free(path);
+    return result;
+}
+
+// =============================
+// Add disk image info file to hold at minimum the size of this disk image
+// =============================
+static bool add_disk_image_info_file(Gpt_Image *image) {
+    char file_buf[32];
+    const int len = snprintf(file_buf, 
+                             sizeof file_buf,
+                             "DISK_SIZE=%"PRIu64"\n", 
+                             image->image_size);
+
+    char path[25] = { 0 };
+    strcpy(path, "/EFI/BOOT/DSKIMG.INF");
+    if (!add_buffer_to_esp(path, "DSKIMG.INF", file_buf, len, image)) return false;
+
+    return true;
+}
+
+// =============================
+// Get next lba to put a data partition file at, after a file at a given lba;
+//   files start 4KiB aligned, so they can share extents with the source files on 
+//   reflink capable filesystems
+// =============================
+static uint64_t next_data_file_lba(const Gpt_Image *image, const uint64_t lba, const uint64_t size) {
+    const uint64_t file_align_lbas = bytes_to_lbas(image, 4096);
+    uint64_t next_lba = lba + bytes_to_lbas(image, size) + file_align_lbas - 1;
+    return next_lba - (next_lba % file_align_lbas);
+}
+
+// =============================
+// Add a file to the list of data partition files; returns its index, or -1 on error
+// =============================
+static int64_t add_data_file_info(Gpt_Image *image, const char *name, const uint64_t size,
+                                  const uint32_t crc32, const uint64_t lba) {
+    if (image->num_data_files == 0 ||
+        (image->num_data_files >= 16 && (image->num_data_files & (image->num_data_files - 1)) == 0)) {
+        // Array is unallocated or full
+        const uint64_t capacity = image->num_data_files == 0 ? 16 : image->num_data_files * 2;
+        Data_File *new_files = realloc(image->data_files, capacity * sizeof *image->data_files);
+        if (!new_files) return -1;
+        image->data_files = new_files;
+    }
+
+    char *name_copy = strdup(name);
+    if (!name_copy) return -1;
+
+    image->data_files[image->num_data_files] = (Data_File){
+        .name = name_copy,
+        .size = size,
+        .crc32 = crc32,
+        .has_crc32 = true,
+        .lba = lba,
+    };
+
+    const uint64_t end_lba = next_data_file_lba(image, lba - image->data_lba, size);
+    if (end_lba > image->data_next_lba) image->data_next_lba = end_lba;
+
+    return image->num_data_files++;
+}
+
+// =============================
+// Read DATAFLS.INF from an existing image's ESP, for the data partition files 
+//   already in the image and their locations
+// =============================
+static bool read_data_files_info(Gpt_Image *image) {
+    const Esp_Node *efi  = esp_dir_find(image->esp_root_dir, "EFI        ");
+    const Esp_Node *boot = (efi  && efi->dir)  ? esp_dir_find(efi->dir,  "BOOT       ") : NULL;
+    const Esp_Node *info = (boot && boot->dir) ? esp_dir_find(boot->dir, "DATAFLS INF") : NULL;
+    if (!info || info->dir) return true;    // No data partition files yet
+
+    const FAT32_Dir_Entry_Short *dir_entry = esp_dir_entry(image, boot->dir, info->entry);
+    if (!dir_entry) return false;
+
+    const uint64_t size = dir_entry->DIR_FileSize;
+    char *file_buf = malloc(size + 1);
+    if (!file_buf) return false;
+
+    if (!esp_read_file(image, info->cluster, size, (uint8_t *)file_buf, NULL)) {
+        free(file_buf);
+        return false;
+    }
+    file_buf[size] = '\0';
+
+    // Each file has FILE_NAME, FILE_SIZE, FILE_CRC32 & DISK_LBA lines, in that order;
+    //   FILE_CRC32 is optional, a file without it has no checksum
+    bool result = true;
+    char *name = NULL;
+    uint64_t file_size = 0;
+    uint32_t file_crc32 = 0;
+    bool has_crc32 = false;
+    char *save = NULL;
+    for (char *line = strtok_r(file_buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        if (!strncmp(line, "FILE_NAME=", 10)) {
+            name = line + 10;
+            file_size = 0;
+            has_crc32 = false;
+        } else if (!strncmp(line, "FILE_SIZE=", 10)) {
+            file_size = strtoull(line + 10, NULL, 10);
+        } else if (!strncmp(line, "FILE_CRC32=", 11)) {
+            file_crc32 = strtoul(line + 11, NULL, 16);
+            has_crc32 = true;
+        } else if (!strncmp(line, "DISK_LBA=", 9) && name) {
+            const uint64_t lba = strtoull(line + 9, NULL, 10);
+            const bool in_partition = lba >= image->data_lba && 
+                lba + bytes_to_lbas(image, file_size) <= image->data_lba + image->data_size_lbas;
+            const int64_t index = in_partition ? add_data_file_info(image, name, file_size, file_crc32, lba) : -1;
+            if (index < 0) {
+                result = false;
+                break;
+            }
+            image->data_files[index].has_crc32 = has_crc32;
+            name = NULL;
+        }
+    }
+
+    free(file_buf);
+    return result;
+}
+
+// =============================
+// Check if a local file has the same data as a range of the image
+// =============================
+static bool file_equals_image(const char *filepath, const Gpt_Image *image, const uint64_t lba, 
+                              const uint64_t size) {
+    FILE *fp = fopen(filepath, "rb");
+    if (!fp) return false;
+
+    const uint64_t chunk_size = ALIGNMENT;
+    uint8_t *chunk = malloc(chunk_size);
+    bool result = chunk != NULL;
+
+    const uint8_t *data = image_lba(image, lba);
+    for (uint64_t offset = 0; result && offset < size; offset += chunk_size) {
+        const uint64_t len = (size - offset < chunk_size) ? size - offset : chunk_size;
+        result = fread(chunk, 1, len, fp) == len && !memcmp(chunk, data + offset, len);
+    }
+
+    free(chunk);
+    fclose(fp);
+    return result;
+}
+
+// =============================
+// Find a data partition file with the same data as a local file, so they can share
+//   lbas; only files of the same size are checked, by CRC32 and then byte by byte.
+//   Data already streamed into the image at stream_lba (if not 0) is compared instead 
+//   of the local file, with its CRC32 given in crc.
+//   Returns index in data_files[] or -1 if none, and the local file's CRC32 in crc;
+//   have_crc is set if crc is known, it is only calculated if there is a file to compare
+// =============================
+static int64_t find_duplicate_data_file(Gpt_Image *image, const char *filepath, const uint64_t stream_lba,
+                                        const uint64_t size, const int64_t skip, uint32_t *crc, 
+                                        bool *have_crc) {
+    *have_crc = stream_lba != 0;
+    if (stream_lba) run_copy_jobs(image);
+
+    for (uint64_t i = 0; i < image->num_data_files; i++) {
+        if ((int64_t)i == skip || !image->data_files[i].name || image->data_files[i].size != size) continue;
+
+        if (!*have_crc) {
+            // Copy planned files first, so their data & CRC32s are in place to compare
+            run_copy_jobs(image);
+            if (!file_crc32(filepath, crc)) return -1;
+            *have_crc = true;
+        }
+
+        Data_File *file = &image->data_files[i];
+        if (file->name && (!file->has_crc32 || file->crc32 == *crc) &&
+            (stream_lba ? !memcmp(image_lba(image, file->lba), image_lba(image, stream_lba), size)
+                        : file_equals_image(filepath, image, file->lba, size))) {
+            file->crc32 = *crc;     // Fill in a missing CRC32, data is the same
+            file->has_crc32 = true;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// =============================
+// Check if a data partition file's lbas are shared with any other non-empty file
+// =============================
+static bool data_file_shared(const Gpt_Image *image, const int64_t index) {
+    for (uint64_t i = 0; i < image->num_data_files; i++) {
+        if ((int64_t)i != index && image->data_files[i].name && image->data_files[i].size > 0 &&
+            image->data_files[i].lba == image->data_files[index].lba)
+            return true;
+    }
+    return false;
+}
+
+// =============================
+// Read a stream into the free space after all data partition files, where new files go;
+//   size is the expected size or UINT64_MAX if not known, and gets the actual size
+// =============================
+static bool stream_to_data_partition(FILE *stream, const char *filepath, Gpt_Image *image, uint64_t *size, 
+                                     uint32_t *crc) {
+    const uint64_t expected_size = *size;
+    const uint64_t lba = image->data_lba + image->data_next_lba;
+
+    // Leave the last lba free, same as for local files
+    uint64_t max_size = image->data_next_lba + 1 < image->data_size_lbas ? 
+                        (image->data_size_lbas - image->data_next_lba - 1) * image->lba_size : 0;
+    if (max_size > expected_size) max_size = expected_size;
+
+    bool result = copy_stream_to_image(stream, image, lba, max_size, size, crc);
+    if (!result) {
+        fprintf(stderr, 
+                "Error: Could not read '%s', or it would overrun Data Partition size "
+                "%"PRIu64 "(%"PRIu64" LBAs)\n", 
+                filepath, 
+                image->data_size, image->data_size_lbas);
+    } else if (expected_size != UINT64_MAX && *size != expected_size) {
+        fprintf(stderr, "Error: '%s' has %"PRIu64" bytes, expected %"PRIu64"\n", 
+                filepath, *size, expected_size);
+        result = false;
+    }
+
+    // Don't leave partial data in free space, new files are only written where not 0
+    if (!result) image_zero_lbas(image, lba, bytes_to_lbas(image, *size));
+    return result;
+}
+
+// =============================
+// Add file to the Basic Data Partition; the file's lbas are planned here, its data is
+//   copied when its batch of copies is ran. A file with the same data as a file already
+//   added shares that file's lbas instead. When updating an existing image, a file 
+//   with the same name is only rewritten if its data changed.
+//   A pipe or stdin ("-:NAME[:SIZE]") is read now instead, after all other files
+// =============================
+static bool add_file_to_data_partition(const char *filepath, Gpt_Image *image) {
+    // Get file size, or read stream to find its size
+    FILE *stream = NULL;
+    uint64_t file_size_bytes = 0;
+    if (!open_input(filepath, &stream, &file_size_bytes)) return false;
+
+    uint64_t stream_lba = 0;
+    uint32_t stream_crc32 = 0;
+    if (stream) {
+        stream_lba = image->data_lba + image->data_next_lba;
+        const bool streamed = stream_to_data_partition(stream, filepath, image, &file_size_bytes, 
+                                                       &stream_crc32);
+        close_input(stream);
+        if (!streamed) return false;
+    }
+    const uint64_t file_size_lbas = bytes_to_lbas(image, file_size_bytes);
+
+    char stdin_name[256];
+    uint64_t stdin_size = 0;
+    const char *name = NULL;
+    const char *slash = strrchr(filepath, '/'); 
+    if (parse_stdin_arg(filepath, stdin_name, sizeof stdin_name, &stdin_size)) name = stdin_name;
+    else if (!slash) name = filepath;
+    else name = slash + 1;
+
+    // Look for file already in the data partition of an existing image
+    int64_t index = -1;
+    for (uint64_t i = 0; image->update_image && i < image->num_data_files && index < 0; i++) {
+        if (image->data_files[i].name && !strcmp(image->data_files[i].name, name))
+            index = i;
+    }
+
+    // New files go after all other files
+    uint64_t lba = image->data_lba + image->data_next_lba;
+    if (index >= 0) {
+        Data_File *file = &image->data_files[index];
+        if (file->size == file_size_bytes) {
+            uint32_t file_crc = stream_crc32;
+            if (!stream_lba && !file_crc32(filepath, &file_crc)) {
+                fprintf(stderr, "Error: Could not read file '%s'\n", filepath);
+                return false;
+            }
+            if ((!file->has_crc32 || file_crc == file->crc32) &&
+                (stream_lba ? !memcmp(image_lba(image, file->lba), image_lba(image, stream_lba), 
+                                      file_size_bytes)
+                            : file_equals_image(filepath, image, file->lba, file_size_bytes))) {
+                // Same data, nothing to do but fill in a missing CRC32; clear streamed copy from free space
+                file->crc32 = file_crc;
+                file->has_crc32 = true;
+                if (stream_lba) image_zero_lbas(image, stream_lba, file_size_lbas);
+                return true;
+            }
+        }
+    }
+
+    // Share lbas of an identical file, if any
+    uint32_t duplicate_crc = stream_crc32;
+    bool has_crc = false;
+    const int64_t duplicate = find_duplicate_data_file(image, filepath, stream_lba, file_size_bytes,
+                                                       index, &duplicate_crc, &has_crc);
+    if (duplicate >= 0) {
+        lba = image->data_files[duplicate].lba;
+        if (stream_lba) image_zero_lbas(image, stream_lba, file_size_lbas);
+    } else if (index >= 0 && !stream_lba && !data_file_shared(image, index)) {
+        // Rewrite file in place if it still fits before the next file, otherwise move it
+        //   after all other files
+        const Data_File *file = &image->data_files[index];
+        uint64_t next_file_lba = image->data_lba + image->data_size_lbas;
+        for (uint64_t i = 0; i < image->num_data_files; i++) {
+            if (image->data_files[i].name && image->data_files[i].lba > file->lba &&
+                image->data_files[i].lba < next_file_lba)
+                next_file_lba = image->data_files[i].lba;
+        }
+        if (file->lba + file_size_lbas <= next_file_lba) lba = file->lba;
+    }
+
+    // Check if adding next file will overrun data partition size
+    const bool updated = index >= 0;
+    if (duplicate < 0 && (lba - image->data_lba + file_size_lbas) * image->lba_size >= image->data_size) {
+        fprintf(stderr, 
+                "Error: Can't add file %s to Data Partition; "
+                "Data Partition size is %"PRIu64 "(%"PRIu64" LBAs) and all files added "
+                "would overrun this size\n",
+                filepath,
+                image->data_size, image->data_size_lbas);
+        return false;
+    }
+
+    if (updated) {
+        // Clear old data before rewriting/moving file, unless another file still uses it
+        Data_File *file = &image->data_files[index];
+        if (!data_file_shared(image, index))
+            image_zero_lbas(image, file->lba, bytes_to_lbas(image, file->size));
+        file->size = file_size_bytes;
+        file->crc32 = duplicate_crc;
+        file->has_crc32 = has_crc;
+        file->lba = lba;
+
+        const uint64_t end_lba = next_data_file_lba(image, lba - image->data_lba, file_size_bytes);
+        if (end_lba > image->data_next_lba) image->data_next_lba = end_lba;
+    } else {
+        index = add_data_file_info(image, name, file_size_bytes, duplicate_crc, lba);
+        if (index < 0) {
+            fprintf(stderr, "Error: Could not allocate memory for file info '%s'\n", filepath);
+            return false;
+        }
+        image->data_files[index].has_crc32 = has_crc;
+    }
+
+    // Plan copy of file data into data partition, if its data is not already there
+    if (duplicate < 0 && !stream_lba && !queue_copy_job(image, filepath, lba, file_size_bytes, index)) {
+        fprintf(stderr, "Error: Could not allocate memory for file copy '%s'\n", filepath);
+        return false;
+    }
+
+    // Print info to user
+    if (image->config.quiet) {
+        return true;
+    } else if (duplicate >= 0) {
+        printf("%s '%s' from path '%s' %s Data Partition, sharing data with '%s'\n", 
+               updated ? "Updated" : "Added",
+               name,
+               filepath,
+               updated ? "in" : "to",
+               image->data_files[duplicate].name);
+    } else if (updated) {
+        printf("Updated '%s' from path '%s' in Data Partition\n", 
+               name,
+               filepath);
+    } else {
+        printf("Added '%s' from path '%s' to Data Partition\n", 
+               name,
+               filepath);
+    }
+
+    return true;
+}
+
+// =============================
+// Read the next line of a file, of any length, into a growing malloc-ed buffer; 
+//   like POSIX getline(), which mingw doesn't have. Returns false at end of file
+// =============================
+static bool read_line(char **line, size_t *cap, FILE *fp) {
+    size_t len = 0;
+    while (true) {
+        if (*cap - len < 2) {
+            const size_t new_cap = *cap ? *cap * 2 : 256;
+            char *new_line = realloc(*line, new_cap);
+            if (!new_line) return false;
+            *line = new_line;
+            *cap = new_cap;
+        }
+        if (!fgets(*line + len, *cap - len, fp)) return len > 0;
+
+        len += strlen(*line + len);
+        if (len > 0 && (*line)[len - 1] == '\n') return true;
+    }
+}
+
+// =============================
+// Add files listed in a manifest file to the ESP and/or Basic Data Partition.
+//   Manifest is read 1 line at a time, and each file is opened, added and closed
+//   before the next line is read, so any number of files can be listed.
+//   Each line is one of:
+//     esp <ESP directory path> <local file>
+//     data <local file>
+//   Blank lines and lines starting with '#' are ignored.
+// =============================
+static bool add_manifest_files(const char *manifest, Gpt_Image *image) {
+    FILE *fp = fopen(manifest, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error: Could not open manifest file '%s'\n", manifest);
+        return false;
+    }
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    uint64_t line_num = 0;
+    bool result = true;
+
+    while (read_line(&line, &line_cap, fp)) {
+        line_num++;
+
+        // Trim trailing newline/whitespace & leading whitespace
+        char *end = line + strlen(line);
+        while (end > line && isspace((unsigned char)end[-1])) *--end = '\0';
+
+        char *target = line;
+        while (isspace((unsigned char)*target)) target++;
+        if (*target == '\0' || *target == '#') continue;
+
+        // Split off partition target, then remaining fields
+        char *rest = target;
+        while (*rest && !isspace((unsigned char)*rest)) rest++;
+        if (*rest) *rest++ = '\0';
+        while (isspace((unsigned char)*rest)) rest++;
+
+        if (!strcmp(target, "esp")) {
+            // ESP directory path, then local file; file name may contain spaces
+            char *dir_path = rest;
+            char *filepath = dir_path;
+            while (*filepath && !isspace((unsigned char)*filepath)) filepath++;
+            if (*filepath) *filepath++ = '\0';
+            while (isspace((unsigned char)*filepath)) filepath++;
+
+            if (dir_path[0] != '/' || dir_path[strlen(dir_path) - 1] != '/' || !*filepath) {
+                fprintf(stderr, 
+                        "Error: Manifest '%s' line %"PRIu64": expected 'esp <path> <file>', "
+                        "with path starting and ending with slash '/'\n",
+                        manifest, line_num);
+                result = false;
+                continue;
+            }
+
+            if (!add_local_file_to_esp(dir_path, filepath, image)) {
+                fprintf(stderr,
+                        "ERROR: Could not add '%s' to ESP path '%s'\n",
+                        filepath, dir_path);
+                result = false;
+            }
+        } else if (!strcmp(target, "data")) {
+            if (!*rest) {
+                fprintf(stderr, 
+                        "Error: Manifest '%s' line %"PRIu64": expected 'data <file>'\n",
+                        manifest, line_num);
+                result = false;
+                continue;
+            }
+
+            if (!add_file_to_data_partition(rest, image)) {
+                fprintf(stderr,
+                        "ERROR: Could not add file '%s' to data partition\n",
+                        rest);
+                result = false;
+            }
+        } else {
+            fprintf(stderr, 
+                    "Error: Manifest '%s' line %"PRIu64": unknown partition '%s', "
+                    "must be 'esp' or 'data'\n",
+                    manifest, line_num, target);
+            result = false;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+    return result;
+}
+
+// =============================
+// Store a value as Big Endian bytes, for vhd fields
+// =============================
+static void put_be(uint8_t *dest, const uint64_t value, const uint8_t num_bytes) {
+    for (uint8_t i = 0; i < num_bytes; i++)
+        dest[i] = (value >> ((num_bytes - 1 - i) * 8)) & 0xFF;
+}
+
+// =============================
+// Get vhd checksum of a footer or dynamic header; checksum field must be 0
+// Code Taken from Microsoft VHD documentation
+// =============================
+static uint32_t vhd_checksum(const void *buf, const size_t size) {
+    uint32_t checksum = 0;
+    const uint8_t *bufp = buf;
+    for (size_t counter = 0; counter < size; counter++) 
+        checksum += bufp[counter];
+
+    return ~checksum;
+}
+
+// =============================
+// Fill out a Virtual Hard Disk footer for a disk of vhd_image_size bytes; 
+//   disk_type is 2 for fixed or 3 for dynamic, data_offset is the dynamic header's
+//   offset or UINT64_MAX for none
+// =============================
+static Vhd new_vhd_footer(const Gpt_Image *image, const uint64_t vhd_image_size, const uint8_t disk_type,
+                          const uint64_t data_offset) {
+    // Fill out VHD footer info
+    Vhd vhd = {
+        .cookie = { "conectix" },
+        .features = { 0 },
+        .version = { 0x00, 0x01, 0x00, 0x00 },
+        .data_offset = 0,
+        .timestamp = { 0 }, // # of seconds since 01/01/2000
+        .creator_app = { "qfic" },
+        .creator_ver = { 0x00, 0x01, 0x00, 0x00},
+        .creator_OS = { "MYOS" },
+        .original_size = { 0 },
+        .current_size = { 0 },
+        .disk_geometry = { 0 },
+        .disk_type = { 0x00, 0x00, 0x00, disk_type }, // 2 = Fixed, 3 = Dynamic hard disk
+        .checksum = { 0 },
+        .unique_id = new_guid(),
+        .saved_state = 0,
+        .reserved = { 0 },
+    };
+
+    // Unix epoch for 01/01/2000 = 946684800,
+    //  subtract this value from epoch 01/01/1970 to translate
+    //  to correct timestamp
+    uint32_t time_u32 = (uint32_t)time(NULL) - 946684800; 
+    vhd.timestamp[0] = (time_u32 >> 24) & 0xFF;
+    vhd.timestamp[1] = (time_u32 >> 16) & 0xFF;
+    vhd.timestamp[2] = (time_u32 >>  8) & 0xFF;
+    vhd.timestamp[3] = time_u32 & 0xFF;
+
+    put_be((uint8_t *)&vhd.data_offset, data_offset, sizeof vhd.data_offset);
+
+    vhd.original_size[0] = (vhd_image_size >> 56) & 0xFF;
+    vhd.original_size[1] = (vhd_image_size >> 48) & 0xFF;
+    vhd.original_size[2] = (vhd_image_size >> 40) & 0xFF;
+    vhd.original_size[3] = (vhd_image_size >> 32) & 0xFF;
+    vhd.original_size[4] = (vhd_image_size >> 24) & 0xFF;
+    vhd.original_size[5] = (vhd_image_size >> 16) & 0xFF;
+    vhd.original_size[6] = (vhd_image_size >>  8) & 0xFF;
+    vhd.original_size[7] = vhd_image_size & 0xFF;
+
+    memcpy(vhd.current_size, vhd.original_size, sizeof vhd.original_size); 
+
+    // Fill out disk geometry (CHS values)
+    // Code Taken from Microsoft VHD documentation
+    uint32_t totalSectors;
+    uint16_t cylinders;
+    uint8_t heads, sectorsPerTrack;
+    uint32_t cylinderTimesHeads;
+
+    totalSectors = image->image_size_lbas;
+    //                  C      H     S
+    if (totalSectors > 65535 * 16 * 255)
+        totalSectors = 65535 * 16 * 255;
+
+    if (totalSectors >= 65535 * 16 * 63) {
+        sectorsPerTrack = 255;
+        heads = 16;
+        cylinderTimesHeads = totalSectors / sectorsPerTrack;
+    } else {
+        sectorsPerTrack = 17;
+        cylinderTimesHeads = totalSectors / sectorsPerTrack;
+
+        heads = (cylinderTimesHeads + 1023) / 1024;
+
+        if (heads < 4) heads = 4;
+
+        if (cylinderTimesHeads >= (heads * 1024) || heads > 16) {
+            sectorsPerTrack = 31;
+            heads = 16;
+            cylinderTimesHeads = totalSectors / sectorsPerTrack;
+        }
+
+        if (cylinderTimesHeads >= (heads * 1024)) {
+            sectorsPerTrack = 63;
+            heads = 16;
+            cylinderTimesHeads = totalSectors / sectorsPerTrack;
+        }
+    }
+    cylinders = cylinderTimesHeads / heads;
+
+    // CHS values for disk geometry: Cylinders 2 bytes, heads 1 byte, sectorsPerTrack 1 byte
+    vhd.disk_geometry[0] = (cylinders >> 8) & 0xFF;
+    vhd.disk_geometry[1] = cylinders & 0xFF;
+    vhd.disk_geometry[2] = heads;
+    vhd.disk_geometry[3] = sectorsPerTrack;
+
+    // Fill out checksum
+    const uint32_t checksum = vhd_checksum(&vhd, sizeof vhd);
+    vhd.checksum[0] = (checksum >> 24) & 0xFF;
+    vhd.checksum[1] = (checksum >> 16) & 0xFF;
+    vhd.checksum[2] = (checksum >>  8) & 0xFF;
+    vhd.checksum[3] = checksum & 0xFF;
+
+    return vhd;
+}
+
+// =============================
+// Add a fixed Virtual Hard Disk footer to the disk image
+// =============================
+static void add_fixed_vhd_footer(Gpt_Image *image) {
+    // Disk image size is everything before the footer (should be 4KiB aligned - 512 bytes)
+    //   and use 4KiB aligned size for vhd footer to not have "corrupted" image
+    const uint64_t vhd_image_size = image->size - sizeof(Vhd);
+    const Vhd vhd = new_vhd_footer(image, vhd_image_size, 2, UINT64_MAX);
+
+    // Write footer to end of file
+    memcpy(image->data + vhd_image_size, &vhd, sizeof vhd);
+}
+
+// =============================
+// Write the disk image as a dynamic Virtual Hard Disk file: footer copy, dynamic header,
+//   Block Allocation Table, then only the 2 MiB blocks of the image that hold any data,
+//   each after its sector bitmap, and the footer at the end
+// =============================
+static bool write_dynamic_vhd(const Gpt_Image *image, const char *name) {
+    // Same disk size as a fixed vhd of this image
+    const uint64_t vhd_image_size = image->size - sizeof(Vhd);
+    const uint32_t num_blocks = (vhd_image_size + VHD_BLOCK_SIZE - 1) / VHD_BLOCK_SIZE;
+    const uint64_t table_offset = sizeof(Vhd) + sizeof(Vhd_Dynamic_Header);
+    const uint64_t table_size = ((uint64_t)num_blocks * 4 + 511) & ~(uint64_t)511;
+
+    const Vhd vhd = new_vhd_footer(image, vhd_image_size, 3, sizeof(Vhd));
+
+    Vhd_Dynamic_Header header = { .cookie = { "cxsparse" } };
+    memset(header.data_offset, 0xFF, sizeof header.data_offset);    // Unused, all 1s
+    put_be(header.table_offset, table_offset, sizeof header.table_offset);
+    put_be(header.header_version, 0x00010000, sizeof header.header_version);
+    put_be(header.max_table_entries, num_blocks, sizeof header.max_table_entries);
+    put_be(header.block_size, VHD_BLOCK_SIZE, sizeof header.block_size);
+    put_be(header.checksum, vhd_checksum(&header, sizeof header), sizeof header.checksum);
+
+    // Unallocated blocks have BAT entry 0xFFFFFFFF; all sectors in an allocated block 
+    //   are marked as present in its bitmap (1 bit per sector, padded to 512 bytes)
+    uint8_t *table = malloc(table_size);
+    uint8_t bitmap[((VHD_BLOCK_SIZE / 512 / 8) + 511) & ~511];
+    FILE *fp = fopen(name, "wb");
+    if (!table || !fp) {
+        free(table);
+        if (fp) fclose(fp);
+        return false;
+    }
+    memset(table, 0xFF, table_size);
+    memset(bitmap, 0xFF, sizeof bitmap);
+
+    bool result = fwrite(&vhd, sizeof vhd, 1, fp) == 1 &&
+                  fwrite(&header, sizeof header, 1, fp) == 1 &&
+                  fwrite(table, table_size, 1, fp) == 1;
+
+    uint64_t next_sector = (table_offset + table_size) / 512;
+    uint32_t num_allocated = 0;
+    for (uint32_t i = 0; result && i < num_blocks; i++) {
+        const uint64_t offset = (uint64_t)i * VHD_BLOCK_SIZE;
+        const uint64_t len = (vhd_image_size - offset < VHD_BLOCK_SIZE) ? vhd_image_size - offset
+                                                                      : VHD_BLOCK_SIZE;
+        if (image_is_zero(image, offset, len)) continue;
+
+        // Last block may be partial, rest of the block is 0s
+        put_be(table + i * 4, next_sector, 4);
+        result = fwrite(bitmap, sizeof bitmap, 1, fp) == 1 &&
+                 fwrite(image->data + offset, len, 1, fp) == 1 &&
+                 fseeko(fp, VHD_BLOCK_SIZE - len, SEEK_CUR) == 0;
+
+        next_sector += (sizeof bitmap + VHD_BLOCK_SIZE) / 512;
+        num_allocated++;
+    }
+
+    // Footer at end of file, then fill in BAT
+    result = result && fwrite(&vhd, sizeof vhd, 1, fp) == 1 && 
+             fseeko(fp, table_offset, SEEK_SET) == 0 && 
+             fwrite(table, table_size, 1, fp) == 1;
+
+    if (fclose(fp) != 0) result = false;
+    free(table);
+
+    if (result && !image->config.quiet) 
+        printf("Wrote dynamic VHD with %"PRIu32" of %"PRIu32" 2MiB blocks allocated\n",
+               num_allocated, num_blocks);
+    return result;
+}
+
+// =============================
+// Write the disk image as a qcow2 v3 file: header, L1 table, refcount table & blocks,
+//   L2 tables, then only the 64 KiB clusters of the image that hold any data. Clusters
+//   are deflate compressed when compress is set, where that makes them smaller
+// =============================
+static bool write_qcow2(const Gpt_Image *image, const char *name, const bool compress) {
+    const uint64_t cs = QCOW2_CLUSTER_SIZE;
+    const uint64_t l2_entries = cs / sizeof(uint64_t);
+    const uint64_t refcounts_per_block = cs / sizeof(uint16_t);   // 16 bit refcounts
+    const uint64_t num_clusters = (image->size + cs - 1) / cs;
+    const uint64_t l1_size = (num_clusters + l2_entries - 1) / l2_entries;
+    const uint64_t l1_clusters = (l1_size * sizeof(uint64_t) + cs - 1) / cs;
+
+    // Find clusters holding data, and the L2 tables needed to map them
+    uint8_t *used = calloc(num_clusters, 1);
+    uint64_t *l2_index = malloc(l1_size * sizeof *l2_index);
+    if (!used || !l2_index) {
+        free(used);
+        free(l2_index);
+        return false;
+    }
+    memset(l2_index, 0xFF, l1_size * sizeof *l2_index);  // UINT64_MAX = no L2 table
+
+    uint64_t num_data = 0, num_l2 = 0;
+    for (uint64_t i = 0; i < num_clusters; i++) {
+        const uint64_t len = (image->size - i * cs < cs) ? image->size - i * cs : cs;
+        if (image_is_zero(image, i * cs, len)) continue;
+
+        used[i] = 1;
+        num_data++;
+        if (l2_index[i / l2_entries] == UINT64_MAX) l2_index[i / l2_entries] = num_l2++;
+    }
+
+    // Host file clusters: header, L1, refcount table, refcount blocks, L2 tables, data;
+    //   refcount blocks also count themselves & the refcount table, so repeat until the
+    //   sizes settle. Compressed data never needs more clusters than uncompressed
+    uint64_t rt_clusters = 0, rb_clusters = 0, total = 0;
+    do {
+        total = 1 + l1_clusters + rt_clusters + rb_clusters + num_l2 + num_data;
+        rb_clusters = (total + refcounts_per_block - 1) / refcounts_per_block;
+        rt_clusters = (rb_clusters * sizeof(uint64_t) + cs - 1) / cs;
+    } while (total != 1 + l1_clusters + rt_clusters + rb_clusters + num_l2 + num_data);
+
+    const uint64_t l1_offset = cs;
+    const uint64_t rt_offset = l1_offset + l1_clusters * cs;
+    const uint64_t rb_offset = rt_offset + rt_clusters * cs;
+    const uint64_t l2_offset = rb_offset + rb_clusters * cs;
+    const uint64_t data_offset = l2_offset + num_l2 * cs;
+
+    uint64_t *l1 = calloc(l1_clusters * l2_entries, sizeof *l1);
+    uint64_t *rt = calloc(rt_clusters * l2_entries, sizeof *rt);
+    uint16_t *refcounts = calloc(rb_clusters * refcounts_per_block, sizeof *refcounts);
+    uint64_t *l2 = calloc(num_l2 * l2_entries, sizeof *l2);
+    uint8_t *cluster = calloc(1, cs);
+    uint8_t *zbuf = malloc(cs);
+    FILE *fp = fopen(name, "wb");
+    z_stream strm = { 0 };
+    bool result = l1 && rt && refcounts && (l2 || num_l2 == 0) && cluster && zbuf && fp &&
+                  (!compress || deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 
+                                             -12, 9, Z_DEFAULT_STRATEGY) == Z_OK);
+
+    // Metadata clusters are each used once
+    for (uint64_t i = 0; result && i < data_offset / cs; i++)
+        refcounts[i] = 1;
+
+    // Copy each used cluster after all metadata
+    uint64_t host_offset = data_offset;
+    if (result && fseeko(fp, host_offset, SEEK_SET) != 0) result = false;
+    uint64_t num_compressed = 0;
+    for (uint64_t i = 0; result && i < num_clusters; i++) {
+        if (!used[i]) continue;
+
+        // Last cluster may be partial, rest of the cluster is 0s
+        const uint8_t *data = image->data + i * cs;
+        if (image->size - i * cs < cs) {
+            memcpy(cluster, data, image->size - i * cs);
+            data = cluster;
+        }
+        uint64_t *entry = &l2[l2_index[i / l2_entries] * l2_entries + (i % l2_entries)];
+
+        uint64_t zlen = 0;
+        if (compress && deflateReset(&strm) == Z_OK) {
+            strm.next_in = (uint8_t *)data;
+            strm.avail_in = cs;
+            strm.next_out = zbuf;
+            strm.avail_out = cs;
+            if (deflate(&strm, Z_FINISH) == Z_STREAM_END && strm.total_out < cs)
+                zlen = strm.total_out;
+        }
+
+        if (zlen > 0) {
+            // Compressed clusters are packed byte aligned; entry has host offset, and # of 
+            //   512 byte sectors used after the 1st sector. Each host cluster holding
+            //   any compressed data is counted once per compressed cluster in it
+            const uint64_t num_sectors = (host_offset + zlen - 1) / 512 - host_offset / 512;
+            *entry = (1ULL << 62) | (num_sectors << (62 - (QCOW2_CLUSTER_BITS - 8))) | host_offset;
+            result = fwrite(zbuf, zlen, 1, fp) == 1;
+
+            for (uint64_t c = host_offset / cs; c <= (host_offset + zlen - 1) / cs; c++)
+                refcounts[c]++;
+            host_offset += zlen;
+            num_compressed++;
+        } else {
+            // Uncompressed clusters are cluster aligned; bit 63 = refcount is exactly 1
+            host_offset = (host_offset + cs - 1) & ~(cs - 1);
+            *entry = (1ULL << 63) | host_offset;
+            result = fseeko(fp, host_offset, SEEK_SET) == 0 && fwrite(data, cs, 1, fp) == 1;
+
+            refcounts[host_offset / cs] = 1;
+            host_offset += cs;
+        }
+    }
+
+    // Tables point to L2 tables & refcount blocks, in order after each other
+    for (uint64_t i = 0; i < l1_size; i++) {
+        if (l2_index[i] != UINT64_MAX) l1[i] = (1ULL << 63) | (l2_offset + l2_index[i] * cs);
+    }
+    for (uint64_t i = 0; i < rb_clusters; i++)
+        rt[i] = rb_offset + i * cs;
+
+    // Store all table entries Big Endian
+    for (uint64_t i = 0; result && i < l1_clusters * l2_entries; i++)
+        put_be((uint8_t *)&l1[i], l1[i], sizeof *l1);
+    for (uint64_t i = 0; result && i < rt_clusters * l2_entries; i++)
+        put_be((uint8_t *)&rt[i], rt[i], sizeof *rt);
+    for (uint64_t i = 0; result && i < rb_clusters * refcounts_per_block; i++)
+        put_be((uint8_t *)&refcounts[i], refcounts[i], sizeof *refcounts);
+    for (uint64_t i = 0; result && i < num_l2 * l2_entries; i++)
+        put_be((uint8_t *)&l2[i], l2[i], sizeof *l2);
+
+    Qcow2_Header header = { .magic = { 'Q', 'F', 'I', 0xFB } };
+    put_be(header.version, 3, sizeof header.version);
+    put_be(header.cluster_bits, QCOW2_CLUSTER_BITS, sizeof header.cluster_bits);
+    put_be(header.size, image->size, sizeof header.size);
+    put_be(header.l1_size, l1_size, sizeof header.l1_size);
+    put_be(header.l1_table_offset, l1_offset, sizeof header.l1_table_offset);
+    put_be(header.refcount_table_offset, rt_offset, sizeof header.refcount_table_offset);
+    put_be(header.refcount_table_clusters, rt_clusters, sizeof header.refcount_table_clusters);
+    put_be(header.refcount_order, 4, sizeof header.refcount_order);   // 2^4 = 16 bits
+    put_be(header.header_length, offsetof(Qcow2_Header, end_extension), sizeof header.header_length);
+
+    // Metadata before data; file ends on a cluster boundary
+    result = result &&
+             fseeko(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof header, 1, fp) == 1 &&
+             fseeko(fp, l1_offset, SEEK_SET) == 0 && fwrite(l1, l1_clusters * cs, 1, fp) == 1 &&
+             fwrite(rt, rt_clusters * cs, 1, fp) == 1 &&
+             fwrite(refcounts, rb_clusters * cs, 1, fp) == 1 &&
+             (num_l2 == 0 || fwrite(l2, num_l2 * cs, 1, fp) == 1) &&
+             fflush(fp) == 0 &&
+             ftruncate(fileno(fp), (host_offset + cs - 1) & ~(cs - 1)) == 0;
+
+    if (fp && fclose(fp) != 0) result = false;
+    if (compress) deflateEnd(&strm);
+    free(used);
+    free(l2_index);
+    free(l1);
+    free(rt);
+    free(refcounts);
+    free(l2);
+    free(cluster);
+    free(zbuf);
+
+    if (result && !image->config.quiet)
+        printf("Wrote qcow2 image with %"PRIu64" of %"PRIu64" 64KiB clusters allocated, "
+               "%"PRIu64" compressed\n",
+               num_data, num_clusters, num_compressed);
+    return result;
+}
+
+// =============================
+// Compress data into a single gzip member
+// =============================
+static bool gzip_member(const uint8_t *data, const uint64_t size, uint8_t **out, uint64_t *out_size) {
+    z_stream strm = { 0 };
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    const uint64_t bound = deflateBound(&strm, size);
+    *out = malloc(bound);
+    strm.next_in = (uint8_t *)data;
+    strm.avail_in = size;
+    strm.next_out = *out;
+    strm.avail_out = bound;
+
+    const bool result = *out && deflate(&strm, Z_FINISH) == Z_STREAM_END;
+    *out_size = strm.total_out;
+    deflateEnd(&strm);
+
+    if (!result) {
+        free(*out);
+        *out = NULL;
+    }
+    return result;
+}
+
+// =============================
+// Worker thread to compress gzip chunks; takes the next chunk until all are done
+// =============================
+static void *gzip_worker(void *arg) {
+    Gzip_Batch *batch = arg;
+
+    uint32_t i;
+    while ((i = atomic_fetch_add(&batch->next_chunk, 1)) < batch->num_chunks) {
+        Gzip_Chunk *chunk = &batch->chunks[i];
+
+        // Full chunks of 0s use 1 shared member
+        if (chunk->size == GZIP_CHUNK_SIZE && 
+            image_is_zero(batch->image, chunk->data - batch->image->data, chunk->size))
+            continue;
+
+        if (!gzip_member(chunk->data, chunk->size, &chunk->out, &chunk->out_size))
+            chunk->error = true;
+    }
+
+    return NULL;
+}
+
+// =============================
+// Write the disk image as a gzip file; the image is split into chunks that are each
+//   compressed into their own gzip member by a pool of threads, and written out in
+//   order. Members are concatenated, which gzip tools read as 1 stream. Chunks of all
+//   0s reuse 1 compressed member instead of being compressed again
+// =============================
+static bool write_gzip(const Gpt_Image *image, const char *name) {
+    uint8_t *zeros = calloc(1, GZIP_CHUNK_SIZE);
+    uint8_t *zero_member = NULL;
+    uint64_t zero_member_size = 0;
+    const bool have_zero_member = zeros && gzip_member(zeros, GZIP_CHUNK_SIZE, &zero_member, 
+                                                       &zero_member_size);
+    free(zeros);
+
+    const uint32_t batch_size = image->num_copy_threads * 4;
+    Gzip_Batch batch = { .image = image, .chunks = calloc(batch_size, sizeof *batch.chunks) };
+    pthread_t *threads = calloc(image->num_copy_threads, sizeof *threads);
+    FILE *fp = fopen(name, "wb");
+    bool result = have_zero_member && batch.chunks && threads && fp;
+
+    uint64_t out_size = 0;
+    for (uint64_t offset = 0; result && offset < image->size; ) {
+        // Compress next batch of chunks; main thread also compresses, so start 1 less
+        //   worker thread
+        for (batch.num_chunks = 0; batch.num_chunks < batch_size && offset < image->size; batch.num_chunks++) {
+            const uint64_t size = (image->size - offset < GZIP_CHUNK_SIZE) ? image->size - offset
+                                                                          : GZIP_CHUNK_SIZE;
+            batch.chunks[batch.num_chunks] = (Gzip_Chunk){ .data = image->data + offset, .size = size };
+            offset += size;
+        }
+        atomic_store(&batch.next_chunk, 0);
+
+        uint32_t num_started = 0;
+        while (num_started + 1 < image->num_copy_threads && num_started + 1 < batch.num_chunks &&
+               pthread_create(&threads[num_started], NULL, gzip_worker, &batch) == 0)
+            num_started++;
+
+        gzip_worker(&batch);
+
+        for (uint32_t i = 0; i < num_started; i++)
+            pthread_join(threads[i], NULL);
+
+        // Write members in image order
+        for (uint32_t i = 0; i < batch.num_chunks; i++) {
+            Gzip_Chunk *chunk = &batch.chunks[i];
+            const uint8_t *member = chunk->out ? chunk->out : zero_member;
+            const uint64_t member_size = chunk->out ? chunk->out_size : zero_member_size;
+
+            if (chunk->error || (result && fwrite(member, member_size, 1, fp) != 1))
+                result = false;
+            out_size += member_size;
+            free(chunk->out);
+        }
+    }
+
+    if (fp && fclose(fp) != 0) result = false;
+    free(zero_member);
+    free(batch.chunks);
+    free(threads);
+
+    if (result && !image->config.quiet)
+        printf("Wrote gzip image, %"PRIu64" bytes compressed to %"PRIu64" bytes\n",
+               image->size, out_size);
+    return result;
+}
+
+// =============================
+// Follow a cluster chain in the in-memory FAT for verifying, marking each cluster as 
+//   used; returns # of clusters in chain, or 0 if chain is invalid or crosses another
+// =============================
+static uint64_t verify_chain(const Gpt_Image *image, uint8_t *used, uint32_t cluster, const char *path) {
+    uint64_t num_clusters = 0;
+    while (true) {
+        if (cluster < 2 || cluster >= image->fat32_num_clusters || image->fat32_fat[cluster] == 0) {
+            fprintf(stderr, "Error: '%s' has invalid or free cluster %"PRIu32" in its chain\n", 
+                    path, cluster);
+            return 0;
+        }
+        if (used[cluster]) {
+            fprintf(stderr, "Error: '%s' is cross-linked at cluster %"PRIu32"\n", path, cluster);
+            return 0;
+        }
+        used[cluster] = 1;
+        num_clusters++;
+
+        const uint32_t next = image->fat32_fat[cluster] & 0x0FFFFFFF;
+        if (next >= 0x0FFFFFF8) return num_clusters;    // End of chain
+        cluster = next;
+    }
+}
+
+// =============================
+// Verify a directory & everything under it in the ESP; every file's cluster chain must
+//   match its size. Counts dirs & files found, returns # of errors
+// =============================
+static uint64_t verify_esp_dir(const Gpt_Image *image, uint8_t *used, const uint32_t cluster, const char *path,
+                               const uint32_t depth, uint64_t *num_dirs, uint64_t *num_files) {
+    if (depth > 64) {
+        fprintf(stderr, "Error: '%s' is nested too deep, directories may loop\n", path);
+        return 1;
+    }
+    if (verify_chain(image, used, cluster, path) == 0) return 1;
+    (*num_dirs)++;
+
+    uint64_t errors = 0;
+    const uint32_t entries_per_cluster = image->cluster_size / sizeof(FAT32_Dir_Entry_Short);
+    for (uint32_t current = cluster; current; current = fat32_next_cluster(image, current)) {
+        const FAT32_Dir_Entry_Short *entries = image_lba(image, cluster_to_lba(image, current));
+        for (uint32_t i = 0; i < entries_per_cluster; i++) {
+            const FAT32_Dir_Entry_Short *dir_entry = &entries[i];
+            if (dir_entry->DIR_Name[0] == 0x00) return errors; // No more entries
+
+            // Skip deleted entries, long names, volume label, "." & ".."
+            if (dir_entry->DIR_Name[0] == 0xE5 || dir_entry->DIR_Name[0] == '.' ||
+                (dir_entry->DIR_Attr & ATTR_VOLUME_ID)) 
+                continue;
+
+            char name[13], entry_path[1024];
+            short_name_to_str(dir_entry->DIR_Name, name);
+            snprintf(entry_path, sizeof entry_path, "%s/%s", path, name);
+
+            const uint32_t first_cluster = (dir_entry->DIR_FstClusHI << 16) | dir_entry->DIR_FstClusLO;
+            if (dir_entry->DIR_Attr & ATTR_DIRECTORY) {
+                errors += verify_esp_dir(image, used, first_cluster, entry_path, depth + 1, 
+                                         num_dirs, num_files);
+                continue;
+            }
+
+            // Empty files may have no clusters, or 1 cluster
+            (*num_files)++;
+            const uint64_t size = dir_entry->DIR_FileSize;
+            if (first_cluster == 0 && size == 0) continue;
+
+            const uint64_t num_clusters = verify_chain(image, used, first_cluster, entry_path);
+            if (num_clusters == 0) {
+                errors++;
+            } else if (num_clusters != bytes_to_clusters(image, size) && !(size == 0 && num_clusters == 1)) {
+                fprintf(stderr, "Error: '%s' has %"PRIu64" clusters for %"PRIu64" bytes\n",
+                        entry_path, num_clusters, size);
+                errors++;
+            }
+        }
+    }
+    return errors;
+}
+
+// =============================
+// Verify ESP FAT32 filesystem: VBR & backup VBR, FSInfo sectors, FAT copies & every
+//   cluster chain; returns # of errors
+// =============================
+static uint64_t verify_esp(Gpt_Image *image) {
+    if (!read_esp(image)) return 1;
+
+    uint64_t errors = 0;
+    const Vbr *vbr = image_lba(image, image->esp_lba);
+    if (vbr->BPB_BkBootSec == 0 || vbr->BPB_BkBootSec + vbr->BPB_FSInfo >= vbr->BPB_RsvdSecCnt ||
+        memcmp(image_lba(image, image->esp_lba + vbr->BPB_BkBootSec), vbr, sizeof *vbr)) {
+        fprintf(stderr, "Error: ESP backup VBR does not match VBR\n");
+        errors++;
+    }
+
+    for (uint8_t i = 0; i < 2; i++) {
+        const uint64_t lba = image->esp_lba + vbr->BPB_FSInfo + (i == 0 ? 0 : vbr->BPB_BkBootSec);
+        const FSInfo *fsinfo = image_lba(image, lba);
+        if (fsinfo->FSI_LeadSig != 0x41615252 || fsinfo->FSI_StrucSig != 0x61417272 ||
+            fsinfo->FSI_TrailSig != 0xAA550000) {
+            fprintf(stderr, "Error: ESP %sFSInfo sector is invalid\n", i == 0 ? "" : "backup ");
+            errors++;
+        }
+    }
+
+    // All FATs are mirrored
+    const uint64_t fat_size = (uint64_t)vbr->BPB_FATSz32 * image->lba_size;
+    for (uint8_t i = 1; i < vbr->BPB_NumFATs; i++) {
+        if (memcmp(image_lba(image, image->fat32_fats_lba), 
+                   image_lba(image, image->fat32_fats_lba + (i * vbr->BPB_FATSz32)), fat_size)) {
+            fprintf(stderr, "Error: ESP FAT %u does not match FAT 0\n", i);
+            errors++;
+        }
+    }
+
+    // Walk all directories & files, every used cluster must be reached exactly once
+    uint8_t *used = calloc(image->fat32_num_clusters, 1);
+    if (!used) {
+        fprintf(stderr, "Error: Could not allocate memory for ESP verification\n");
+        return errors + 1;
+    }
+
+    uint64_t num_dirs = 0, num_files = 0;
+    errors += verify_esp_dir(image, used, vbr->BPB_RootClus, "", 0, &num_dirs, &num_files);
+
+    uint64_t num_lost = 0, num_free = 0;
+    for (uint32_t cluster = 2; cluster < image->fat32_num_clusters; cluster++) {
+        if (image->fat32_fat[cluster] == 0) num_free++;
+        else if (!used[cluster]) num_lost++;
+    }
+    free(used);
+
+    if (num_lost > 0) {
+        fprintf(stderr, "Error: ESP has %"PRIu64" lost clusters, not in any file or directory\n", 
+                num_lost);
+        errors++;
+    }
+
+    const FSInfo *fsinfo = image_lba(image, image->esp_lba + vbr->BPB_FSInfo);
+    if (fsinfo->FSI_Free_Count != 0xFFFFFFFF && fsinfo->FSI_Free_Count != num_free) {
+        fprintf(stderr, "Error: ESP FSInfo free count is %"PRIu32", %"PRIu64" clusters are free\n",
+                fsinfo->FSI_Free_Count, num_free);
+        errors++;
+    }
+    if (fsinfo->FSI_Nxt_Free != 0xFFFFFFFF && 
+        (fsinfo->FSI_Nxt_Free < 2 || fsinfo->FSI_Nxt_Free >= image->fat32_num_clusters)) {
+        fprintf(stderr, "Error: ESP FSInfo next free cluster %"PRIu32" is out of range\n",
+                fsinfo->FSI_Nxt_Free);
+        errors++;
+    }
+
+    const FSInfo *backup_fsinfo = image_lba(image, image->esp_lba + vbr->BPB_BkBootSec + vbr->BPB_FSInfo);
+    if (vbr->BPB_BkBootSec != 0 && memcmp(backup_fsinfo, fsinfo, sizeof *fsinfo)) {
+        fprintf(stderr, "Error: ESP backup FSInfo differs from primary FSInfo\n");
+        errors++;
+    }
+
+    if (!image->config.quiet)
+        printf("ESP: %"PRIu64" directories, %"PRIu64" files, %"PRIu64" of %"PRIu32" clusters free\n",
+               num_dirs, num_files, num_free, image->fat32_num_clusters - 2);
+    return errors;
+}
+
+// =============================
+// Compare data partition files by lba, for sorting
+// =============================
+static int compare_data_file_lbas(const void *a, const void *b) {
+    const Data_File *file_a = a, *file_b = b;
+    return (file_a->lba > file_b->lba) - (file_a->lba < file_b->lba);
+}
+
+// =============================
+// Verify data partition files listed in DATAFLS.INF: each file's extent must not overlap
+//   another file's, unless they share identical data, and its data must match its CRC32;
+//   returns # of errors
+// =============================
+static uint64_t verify_data_files(Gpt_Image *image) {
+    if (!read_data_files_info(image)) {
+        fprintf(stderr, "Error: DATAFLS.INF is invalid, or lists files outside the Data Partition\n");
+        return 1;
+    }
+
+    uint64_t errors = 0, num_bytes = 0, num_unchecked = 0;
+    if (image->num_data_files > 1)
+        qsort(image->data_files, image->num_data_files, sizeof *image->data_files, compare_data_file_lbas);
+    for (uint64_t i = 0; i < image->num_data_files; i++) {
+        const Data_File *file = &image->data_files[i];
+        const Data_File *prev = i > 0 ? &image->data_files[i - 1] : NULL;
+
+        // Identical files share the same lbas, data is only checked once; 1 of them may
+        //   be listed without a CRC32
+        const bool shared = prev && prev->lba == file->lba && prev->size == file->size;
+        if (shared && prev->has_crc32 == file->has_crc32 && prev->crc32 == file->crc32)
+            continue;
+
+        if (!shared && prev && prev->lba + bytes_to_lbas(image, prev->size) > file->lba) {
+            fprintf(stderr, "Error: Data partition file '%s' overlaps '%s'\n", file->name, prev->name);
+            errors++;
+        }
+
+        // Files listed without a CRC32 only have their extents checked
+        if (!file->has_crc32) {
+            num_unchecked++;
+            continue;
+        }
+        if (calculate_crc32(image_lba(image, file->lba), file->size) != file->crc32) {
+            fprintf(stderr, "Error: Data partition file '%s' does not match its CRC32 %08"PRIX32"\n",
+                    file->name, file->crc32);
+            errors++;
+        }
+        num_bytes += file->size;
+    }
+
+    if (!image->config.quiet)
+        printf("Data Partition: %"PRIu64" files, %"PRIu64" bytes of file data checked, "
+               "%"PRIu64" without a CRC32\n", image->num_data_files, num_bytes, num_unchecked);
+    return errors;
+}
+
+// =============================
+// Verify an existing image: protective MBR, both GPT headers & tables, ESP FAT32
+//   filesystem and data partition files; returns # of errors
+// =============================
+static uint64_t verify_image(Gpt_Image *image) {
+    // Protective MBR, GPT header & table CRCs
+    if (!read_gpts(image)) return 1;
+
+    uint64_t errors = 0;
+    const Gpt_Header *primary_gpt = image_lba(image, 1);
+    const Gpt_Header *secondary_gpt = image_lba(image, primary_gpt->alternate_lba);
+    if (primary_gpt->my_lba != 1 || secondary_gpt->my_lba != primary_gpt->alternate_lba ||
+        secondary_gpt->alternate_lba != 1 ||
+        secondary_gpt->partition_table_crc32 != primary_gpt->partition_table_crc32 ||
+        memcmp(&secondary_gpt->disk_guid, &primary_gpt->disk_guid, sizeof(Guid))) {
+        fprintf(stderr, "Error: Primary & secondary GPT headers do not match\n");
+        errors++;
+    }
+
+    // Every partition must lie in the usable lbas (inclusive ending lbas) and start after the one before it
+    const Gpt_Partition_Entry *gpt_table = image_lba(image, primary_gpt->partition_table_lba);
+    uint64_t next_free_lba = primary_gpt->first_usable_lba;
+    for (uint32_t i = 0; i < NUMBER_OF_GPT_TABLE_ENTRIES; i++) {
+        const Gpt_Partition_Entry *entry = &gpt_table[i];
+        if (is_zero(&entry->partition_type_guid, sizeof(Guid))) continue;   // Unused entry
+
+        if (entry->starting_lba < next_free_lba || entry->ending_lba < entry->starting_lba ||
+            entry->ending_lba > primary_gpt->last_usable_lba) {
+            fprintf(stderr, "Error: GPT partition %"PRIu32" (lbas %"PRIu64"-%"PRIu64") overlaps another "
+                            "partition or is outside the usable lbas %"PRIu64"-%"PRIu64"\n",
+                    i + 1, entry->starting_lba, entry->ending_lba, 
+                    primary_gpt->first_usable_lba, primary_gpt->last_usable_lba);
+            errors++;
+            continue;
+        }
+        next_free_lba = entry->ending_lba + 1;
+    }
+    if (!image->config.quiet)
+        printf("GPT: %"PRIu64" byte LBAs, %"PRIu64" LBAs\n", image->lba_size, image->image_size_lbas);
+
+    errors += verify_esp(image);
+    if (image->esp_root_dir)
+        errors += verify_data_files(image);
+    else
+        fprintf(stderr, "Error: Data partition files not checked, DATAFLS.INF can't be found without the ESP\n");
+    return errors;
+}
+
+// =============================
+// Check image config values are in range & output formats can be combined
+// =============================
+static bool config_valid(const Gpt_Image_Config *config) {
+    if (config->lba_size != 0    && config->lba_size != 512  &&
+        config->lba_size != 1024 && config->lba_size != 2048 && 
+        config->lba_size != 4096) {
+        fprintf(stderr, "Error: Invalid LBA size, must be one of 512/1024/2048/4096\n");
+        return false;
+    }
+
+    if (config->cluster_size != 0 && 
+        (config->cluster_size < 512 || config->cluster_size > FAT32_MAX_CLUSTER_SIZE ||
+         (config->cluster_size & (config->cluster_size - 1)))) {
+        fprintf(stderr, "Error: Invalid cluster size, must be a power of 2 from 512 to %d\n",
+                FAT32_MAX_CLUSTER_SIZE);
+        return false;
+    }
+
+    if (config->esp_align != 0 && 
+        (config->esp_align < 512 || config->esp_align > ALIGNMENT ||
+         (config->esp_align & (config->esp_align - 1)))) {
+        fprintf(stderr, "Error: Invalid ESP alignment, must be a power of 2 from 512 to %d\n",
+                ALIGNMENT);
+        return false;
+    }
+
+    if (config->jobs > 256) {
+        fprintf(stderr, "Error: Invalid # of jobs, must be from 1 to 256\n");
+        return false;
+    }
+
+    if (config->num_partitions > NUMBER_OF_GPT_TABLE_ENTRIES - 2) {
+        fprintf(stderr, "Error: At most %d extra partitions can be added\n", 
+                NUMBER_OF_GPT_TABLE_ENTRIES - 2);
+        return false;
+    }
+
+    // Only allow lba_size = 512 for vhd, the spec says it only uses 512 byte disk sectors
+    if (config->vhd && config->lba_size > 512) {
+        fprintf(stderr, "Error: VHD only allows disk sector size (LBA) = 512 bytes\n");
+        return false;
+    }
+
+    if (config->vhd && config->qcow2) {
+        fprintf(stderr, "Error: Only 1 of VHD or qcow2 output can be used\n");
+        return false;
+    }
+
+    if (config->gzip && (config->vhd_dynamic || config->qcow2)) {
+        fprintf(stderr, "Error: gzip output can only be used for raw images or fixed VHDs\n");
+        return false;
+    }
+
+    return true;
+}
+
+// =============================
+// Allocate a new image object with default sizes, not yet backed by an image file
+// =============================
+static Gpt_Image *image_new(const char *name, const Gpt_Image_Config *config) {
+    Gpt_Image *image = calloc(1, sizeof *image);
+    if (!image) return NULL;
+
+    image->name = strdup(name);
+    if (!image->name) {
+        free(image);
+        return NULL;
+    }
+
+    image->fd = -1;
+    image->config = *config;
+    image->lba_size = config->lba_size ? config->lba_size : 512;
+    image->data_size = (config->data_size ? config->data_size : 1) * ALIGNMENT;
+    image->fat32_lbas_per_cluster = 1;
+    image->esp_align = config->esp_align;   // 0 = cluster size, set once that is known
+
+    // Set # of threads for copying file data, default to 1 per online CPU
+    if (config->jobs) {
+        image->num_copy_threads = config->jobs;
+    } else {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        const long num_cpus = info.dwNumberOfProcessors;
+#else
+        const long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        image->num_copy_threads = num_cpus > 0 ? num_cpus : 1;
+    }
+
+    return image;
+}
+
+// =============================
+// Free an image object & all of its in-memory state, closing its image file if open
+// =============================
+static void image_free(Gpt_Image *image) {
+    if (image->data) image_close(image);
+
+    free(image->fat32_fat);
+    esp_dir_free(image->esp_root_dir);
+
+    for (uint32_t i = 0; i < image->num_copy_jobs; i++)
+        free(image->copy_jobs[i].filepath);
+    free(image->copy_jobs);
+
+    for (uint64_t i = 0; i < image->num_data_files; i++)
+        free(image->data_files[i].name);
+    free(image->data_files);
+
+    for (uint32_t i = 0; i < image->num_partitions; i++) {
+        close_input(image->partitions[i].stream);
+        free(image->partitions[i].spec);
+    }
+    free(image->partitions);
+
+    free(image->name);
+    free(image);
+}
+
+// =============================
+// Print info on sizes and image for user
+// =============================
+static void print_image_info(const Gpt_Image *image) {
+    if (image->config.quiet) return;
+
+    uint64_t partitions_size = 0;
+    for (uint32_t i = 0; i < image->num_partitions; i++)
+        partitions_size += image->partitions[i].size_lbas * image->lba_size;
+
+    printf("IMAGE NAME: %s\n"
+           "LBA SIZE: %"PRIu64"\n"
+           "ESP SIZE: %"PRIu64"MiB\n"
+           "CLUSTER SIZE: %"PRIu64"\n"
+           "DATA SIZE: %"PRIu64"MiB\n"
+           "PADDING: %"PRIu64"MiB\n"
+           "IMAGE SIZE: %"PRIu64"MiB\n",
+
+           image->name,
+           image->lba_size,
+           image->esp_size / ALIGNMENT,
+           image->cluster_size,
+           image->data_size / ALIGNMENT,
+           (image->image_size - image->esp_size - image->data_size - partitions_size) / ALIGNMENT,
+           image->image_size / ALIGNMENT);
+
+    for (uint32_t i = 0; i < image->num_partitions; i++) {
+        const Partition *part = &image->partitions[i];
+        printf("PARTITION %"PRIu32": %s%s%"PRIu64"MiB at LBA %"PRIu64"\n", 
+               i + 3, part->name, part->name[0] ? " " : "", part->size / ALIGNMENT, part->lba);
+    }
+}
+
+// =====================================
+// Create a new image file, with its MBR, GPTs, empty ESP & partitions written
+// =====================================
+Gpt_Image *gpt_image_create(const char *name, const Gpt_Image_Config *config) {
+    if (!config_valid(config)) return NULL;
+
+    // Keep image size in range of a 64 bit byte offset
+    const uint64_t max_mib = (INT64_MAX / 2) / ALIGNMENT;
+    if (config->esp_size > max_mib || config->data_size > max_mib) {
+        fprintf(stderr, "Error: ESP and data partition sizes must be at most %"PRIu64" MiB\n", max_mib);
+        return NULL;
+    }
+
+    Gpt_Image *image = image_new(name, config);
+    if (!image) return NULL;
+
+    // Enforce minimum sizes for ESP according to LBA size: 33/65/129/257 MiB for 
+    //   512/1024/2048/4096, which is also the default
+    const uint64_t min_esp_mib = (image->lba_size / 512) * 32 + 1;
+    if (config->esp_size && config->esp_size < min_esp_mib) {
+        fprintf(stderr, "Error: ESP Must be a minimum of 33/65/129/257 MiB for "
+                        "LBA sizes 512/1024/2048/4096 respectively\n");
+        image_free(image);
+        return NULL;
+    }
+    image->esp_size = (config->esp_size ? config->esp_size : min_esp_mib) * ALIGNMENT; 
+
+    // Set FAT32 cluster size; a cluster is 1 or more whole lbas
+    image->cluster_size = config->cluster_size ? config->cluster_size : 
+                                                 default_cluster_size(image, image->esp_size);
+    if (image->cluster_size < image->lba_size) {
+        fprintf(stderr, "Error: Cluster size must be at least the LBA size (%"PRIu64")\n", 
+                image->lba_size);
+        image_free(image);
+        return NULL;
+    }
+    if (!image->esp_align) image->esp_align = image->cluster_size;
+
+    // Set sizes & LBA values
+    image->gpt_table_lbas = GPT_TABLE_SIZE / image->lba_size;
+
+    // Add extra padding for:
+    //   2 aligned partitions
+    //   2 GPT tables
+    //   MBR
+    //   GPT headers
+    const uint64_t padding = (ALIGNMENT*2 + (image->lba_size * ((image->gpt_table_lbas*2) + 1 + 2))); 
+    image->image_size = image->esp_size + image->data_size + padding; 
+    image->image_size_lbas = bytes_to_lbas(image, image->image_size);
+    image->align_lba = ALIGNMENT / image->lba_size;
+    image->esp_lba = image->align_lba;
+    image->esp_size_lbas = bytes_to_lbas(image, image->esp_size);
+    image->data_size_lbas = bytes_to_lbas(image, image->data_size);
+    image->data_lba = next_aligned_lba(image, image->esp_lba + image->esp_size_lbas);
+
+    // FAT32 volume size in lbas is 32 bits (BPB_TotSec32)
+    if (image->esp_size_lbas > UINT32_MAX) {
+        fprintf(stderr, "Error: ESP can be at most %"PRIu64" MiB for LBA size %"PRIu64"\n",
+                (UINT32_MAX * image->lba_size) / ALIGNMENT, image->lba_size);
+        image_free(image);
+        return NULL;
+    }
+
+    // Reject a cluster size FAT32 can't use for this ESP before the image file is touched
+    if (!fat32_cluster_count_valid(image)) {
+        image_free(image);
+        return NULL;
+    }
+
+    // Lay out extra partitions after the Basic Data Partition, growing the image to fit
+    if (config->num_partitions > 0) {
+        image->partitions = calloc(config->num_partitions, sizeof *image->partitions);
+        if (!image->partitions) {
+            image_free(image);
+            return NULL;
+        }
+
+        for (uint32_t i = 0; i < config->num_partitions; i++) {
+            image->num_partitions++;    // Before parsing, so image_free frees its spec copy
+            if (!parse_partition(config->partitions[i], &image->partitions[i])) {
+                image_free(image);
+                return NULL;
+            }
+        }
+
+        if (!layout_partitions(image)) {
+            image_free(image);
+            return NULL;
+        }
+    }
+
+    // Pad file to next 4KiB aligned size; a vhd footer takes up the last 512 bytes
+    const uint64_t disk_size = image->image_size_lbas * image->lba_size;
+    const uint64_t file_size = disk_size - (disk_size % 4096) + 4096;
+
+    // Create & map image file; a dynamic vhd, qcow2 or gzip image is built as a raw
+    //   image in memory first, and only the converted file is written out
+    const bool convert_image = config->vhd_dynamic || config->qcow2 || config->gzip;
+    if (!(convert_image ? image_open_memory(image, file_size) : image_open(image, image->name, file_size))) {
+        fprintf(stderr, "Error: could not %s %s\n", 
+                convert_image ? "map memory for image" : "open file", image->name);
+        image_free(image);
+        return NULL;
+    }
+
+    print_image_info(image);
+
+    // Write protective MBR
+    if (!write_mbr(image)) {
+        fprintf(stderr, "Error: could not write protective MBR for file %s\n", image->name);
+        image_free(image);
+        return NULL;
+    }
+
+    // Write GPT headers & tables
+    if (!write_gpts(image)) {
+        fprintf(stderr, "Error: could not write GPT headers & tables for file %s\n", image->name);
+        image_free(image);
+        return NULL;
+    }
+
+    // Write EFI System Partition w/FAT32 filesystem
+    if (!write_esp(image)) {
+        fprintf(stderr, "Error: could not write ESP for file %s\n", image->name);
+        image_free(image);
+        return NULL;
+    }
+
+    // Fill extra partitions with their raw contents
+    if (!write_partitions(image)) {
+        fprintf(stderr, "Error: could not write all partition contents to '%s'\n", image->name);
+        image_free(image);
+        return NULL;
+    }
+
+    return image;
+}
+
+// =====================================
+// Open an existing image to add/update files; sizes & layout are read from the image
+// =====================================
+Gpt_Image *gpt_image_open(const char *name, const Gpt_Image_Config *config) {
+    if (config->vhd_dynamic || config->qcow2 || config->gzip) {
+        fprintf(stderr, "Error: Can't update a dynamic VHD, qcow2 or gzip image, only raw "
+                        "images or fixed VHDs\n");
+        return NULL;
+    }
+
+    if (config->num_partitions > 0) {
+        fprintf(stderr, "Error: Extra partitions can only be added when creating a new image\n");
+        return NULL;
+    }
+
+    if (!config_valid(config)) return NULL;
+
+    Gpt_Image *image = image_new(name, config);
+    if (!image) return NULL;
+    image->update_image = true;
+
+    // Map existing image file
+    if (!image_open_existing(image, name, false)) {
+        fprintf(stderr, "Error: could not open existing file %s\n", name);
+        image_free(image);
+        return NULL;
+    }
+
+    if (!read_gpts(image) || !read_esp(image) || !read_data_files_info(image)) {
+        fprintf(stderr, "Error: %s is not a valid image to update\n", name);
+        image_free(image);
+        return NULL;
+    }
+
+    print_image_info(image);
+    return image;
+}
+
+// =====================================
+// Add a local file to a directory path in the ESP
+// =====================================
+bool gpt_image_add_esp_file(Gpt_Image *image, const char *dir_path, const char *filepath) {
+    return add_local_file_to_esp(dir_path, filepath, image);
+}
+
+// =====================================
+// Add a local file to the Basic Data Partition
+// =====================================
+bool gpt_image_add_data_file(Gpt_Image *image, const char *filepath) {
+    return add_file_to_data_partition(filepath, image);
+}
+
+// =====================================
+// Add all files listed in a manifest file to the ESP and/or Basic Data Partition
+// =====================================
+bool gpt_image_add_manifest(Gpt_Image *image, const char *manifest) {
+    return add_manifest_files(manifest, image);
+}
+
+// =====================================
+// Finish an image: copy file data, write info files & FATs, write out any converted
+//   format, then close & free the image
+// =====================================
+bool gpt_image_finalize(Gpt_Image *image) {
+    const Gpt_Image_Config *config = &image->config;
+    bool result = true;
+
+    // Copy all remaining planned file data; this also finishes DATAFLS.INF. Files from
+    //   earlier batches that failed to copy also fail the image
+    if (!run_copy_jobs(image) || image->copy_failed) {
+        fprintf(stderr, "ERROR: Could not copy all file data to '%s'\n", image->name);
+        result = false;
+    }
+
+    if (image->num_data_files > 0) {
+        // List all data partition files in DATAFLS.INF, and add it to the ESP
+        char info_path[25] = { 0 };
+        strcpy(info_path, "/EFI/BOOT/DATAFLS.INF");
+
+        char *info = NULL;
+        size_t info_size = 0;
+        if (!write_data_files_info(image, &info, &info_size) || 
+            !add_buffer_to_esp(info_path, "DATAFLS.INF", info, info_size, image)) {
+            fprintf(stderr, "ERROR: Could not add '%s' to ESP\n", info_path);
+            free(info);
+            image_free(image);
+            return false;
+        }
+        free(info);
+    }
+
+    if (config->vhd && !config->vhd_dynamic && !image->update_image) {
+        // Add a fixed Virtual Hard Disk footer to the disk image; an existing image
+        //   keeps its footer
+        add_fixed_vhd_footer(image);
+        if (!config->quiet) printf("Added VHD footer\n");
+    }
+
+    // Add disk image info file to hold at minimum the size of this disk image;
+    //   this could be used in an EFI application later as part of an installer, for example
+    image->image_size = image->size; // Image size is used to write info file
+    if (!add_disk_image_info_file(image)) {
+        fprintf(stderr, "Error: Could not add disk image info file to '%s'\n", image->name);
+        result = false;
+    }
+
+    // Write FATs & FS Info for all files added to the ESP
+    if (!finalize_esp(image)) {
+        fprintf(stderr, "Error: could not write ESP FATs for file %s\n", image->name);
+        result = false;
+    }
+
+    // Write finished raw image out as a dynamic Virtual Hard Disk
+    if (result && config->vhd_dynamic && !write_dynamic_vhd(image, image->name)) {
+        fprintf(stderr, "Error: could not write dynamic VHD file %s\n", image->name);
+        result = false;
+    }
+
+    // Write finished raw image out as a qcow2 image
+    if (result && config->qcow2 && !write_qcow2(image, image->name, config->qcow2_compressed)) {
+        fprintf(stderr, "Error: could not write qcow2 file %s\n", image->name);
+        result = false;
+    }
+
+    // Write finished raw image out gzip compressed
+    if (result && config->gzip && !write_gzip(image, image->name)) {
+        fprintf(stderr, "Error: could not write gzip file %s\n", image->name);
+        result = false;
+    }
+
+    image_free(image);
+    return result;
+}
+
+// =====================================
+// Close & free an image without finishing it
+// =====================================
+void gpt_image_discard(Gpt_Image *image) {
+    image_free(image);
+}
+
+// =====================================
+// Check an existing image, getting the # of errors found
+// =====================================
+bool gpt_image_verify(const char *name, const bool quiet, uint64_t *errors) {
+    const Gpt_Image_Config config = { .quiet = quiet };
+    Gpt_Image *image = image_new(name, &config);
+    if (!image) return false;
+
+    if (!image_open_existing(image, name, true)) {
+        fprintf(stderr, "Error: could not open existing file %s\n", name);
+        image_free(image);
+        return false;
+    }
+
+    *errors = verify_image(image);
+    image_free(image);
+    return true;
+}
@@ -0,0 +1,78 @@
+#ifndef GPTIMAGE_H
+#define GPTIMAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// -------------------------------------
+// libgptimage: build UEFI bootable GPT disk images with an EFI System Partition
+//   (FAT32), a Basic Data Partition and optional extra partitions.
+//
+// All state for an image lives in its Gpt_Image object, so separate images can be
+//   built from separate threads at the same time. A single image must only be used
+//   from 1 thread at a time. Errors are printed to stderr; progress is printed to
+//   stdout unless config.quiet is set.
+//
+// Usage:
+//   Gpt_Image_Config config = { .esp_size = 64 };
+//   Gpt_Image *image = gpt_image_create("test.hdd", &config);
+//   gpt_image_add_esp_file(image, "/EFI/BOOT/", "BOOTX64.EFI");
+//   gpt_image_add_data_file(image, "kernel.bin");
+//   gpt_image_finalize(image);
+// -------------------------------------
+
+typedef struct Gpt_Image Gpt_Image;
+
+// Image layout & output format; 0/false/NULL for any value picks its default
+typedef struct {
+    uint32_t lba_size;          // 512/1024/2048/4096; default 512
+    uint64_t esp_size;          // MiB; default 33, minimum 33/65/129/257 for each LBA size
+    uint64_t data_size;         // MiB; default 1
+    uint32_t cluster_size;      // ESP FAT32 cluster size in bytes; default picked from ESP size
+    uint32_t esp_align;         // ESP file data alignment in bytes from start of disk;
+                                //   default is the cluster size
+    uint32_t jobs;              // Threads to copy file data with; default 1 per online CPU
+    char **partitions;          // Extra partition layout specs, as for write_gpt -p;
+                                //   copied when parsed, the strings are not modified
+    uint32_t num_partitions;
+    bool vhd;                   // Add a fixed vhd footer
+    bool vhd_dynamic;           // With vhd, write a dynamic vhd instead
+    bool qcow2;
+    bool qcow2_compressed;      // With qcow2, deflate compress clusters
+    bool gzip;
+    bool quiet;                 // Don't print progress to stdout
+} Gpt_Image_Config;
+
+// Create a new image file, with its MBR, GPTs, empty ESP & partitions written.
+//   For converted formats (dynamic vhd, qcow2, gzip), name is the final output file;
+//   Returns NULL on error
+Gpt_Image *gpt_image_create(const char *name, const Gpt_Image_Config *config);
+
+// Open an existing raw image or fixed vhd made by this library, to add/update files.
+//   Sizes & layout are read from the image; only config.esp_align, jobs & quiet are used.
+//   Returns NULL on error
+Gpt_Image *gpt_image_open(const char *name, const Gpt_Image_Config *config);
+
+// Add a local file (or "-:NAME[:SIZE]" for stdin) to a directory path in the ESP,
+//   e.g. "/EFI/BOOT/" + "build/FOO.EFI" adds "/EFI/BOOT/FOO.EFI"
+bool gpt_image_add_esp_file(Gpt_Image *image, const char *dir_path, const char *filepath);
+
+// Add a local file (or "-:NAME[:SIZE]" for stdin) to the Basic Data Partition,
+//   listed in /EFI/BOOT/DATAFLS.INF in the ESP
+bool gpt_image_add_data_file(Gpt_Image *image, const char *filepath);
+
+// Add all files listed in a manifest file, as for write_gpt -m
+bool gpt_image_add_manifest(Gpt_Image *image, const char *manifest);
+
+// Copy all remaining file data, write info files, FATs & any vhd footer, write out
+//   any converted format and close the image. The image is freed even on error
+bool gpt_image_finalize(Gpt_Image *image);
+
+// Close & free an image without finishing it; a new image file is left incomplete
+void gpt_image_discard(Gpt_Image *image);
+
+// Check an existing raw image or fixed vhd; errors is set to the # of problems found.
+//   Returns false if the image could not be opened
+bool gpt_image_verify(const char *name, const bool quiet, uint64_t *errors);
+
+#endif // GPTIMAGE_H
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#ifdef __linux__
+#include <sys/ptrace.h>
+#include <linux/ptrace.h>
+#endif
+
+// -------------------------------------
+// write_gpt benchmark; generates synthetic workloads in a temporary directory, runs
+//   write_gpt on each, and prints 1 JSON object per line per workload:
+//   wall time, payload MB/s, syscall count & peak RSS.
+//   Each workload is ran once for timing, then once more under ptrace to count
+//   syscalls (Linux only, -1 elsewhere), so tracing does not skew the timing.
+//
+// usage: write_gpt_bench [--large] [write_gpt path] [big file MiB] [# of big files]
+//   Defaults write a few hundred MiB of workload files, with 64 MiB big files and
+//   128 MiB/1 GiB/8 GiB ESPs; --large uses 1 GiB big files and 1/8/64 GiB ESPs,
+//   writing several GiB
+// -------------------------------------
+
+// Result of 1 run of write_gpt
+typedef struct {
+    double wall_secs;
+    long max_rss_kb;
+    int64_t syscalls;
+    bool ok;
+} Run_Result;
+
+// Workload to benchmark
+typedef struct {
+    const char *name;
+    const char *manifest;
+    uint32_t lba_size;
+    uint32_t esp_size;      // MiB
+    uint32_t data_size;     // MiB
+    uint64_t files;
+    uint64_t bytes;         // Total payload bytes
+} Workload;
+
+// =====================================
+// Get monotonic time in seconds
+// =====================================
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// =====================================
+// Write a file of pseudo random data; different seeds give different data,
+//   so files are not deduplicated
+// =====================================
+static bool write_file(const char *path, const uint64_t size, uint64_t seed) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return false;
+
+    const size_t chunk_size = 1024 * 1024;
+    uint64_t *chunk = malloc(chunk_size);
+    bool result = chunk != NULL;
+
+    seed = seed * 0x9E3779B97F4A7C15ULL + 1;
+    for (uint64_t offset = 0; result && offset < size; offset += chunk_size) {
+        for (size_t i = 0; i < chunk_size / sizeof *chunk; i++) {
+            // xorshift64
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            chunk[i] = seed;
+        }
+        const size_t len = (size - offset < chunk_size) ? size - offset : chunk_size;
+        result = fwrite(chunk, 1, len, fp) == len;
+    }
+
+    free(chunk);
+    if (fclose(fp) != 0) result = false;
+    return result;
+}
+
+// =====================================
+// Run write_gpt with a workload's options; wall time & peak RSS of the child,
+//   and if count_syscalls, trace all of its threads to count syscalls
+// =====================================
+static Run_Result run_write_gpt(const char *write_gpt, const Workload *work, const bool count_syscalls) {
+    Run_Result result = { .syscalls = -1 };
+
+    char lba_size[16], esp_size[16], data_size[16];
+    snprintf(lba_size, sizeof lba_size, "%"PRIu32, work->lba_size);
+    snprintf(esp_size, sizeof esp_size, "%"PRIu32, work->esp_size);
+    snprintf(data_size, sizeof data_size, "%"PRIu32, work->data_size);
+    char *argv[] = { (char *)write_gpt, "-i", "bench.hdd", "-es", esp_size, "-l", lba_size,
+                     "-ds", data_size, "-m", (char *)work->manifest, NULL };
+
+    unlink("bench.hdd");
+    const double start = now();
+    const pid_t pid = fork();
+    if (pid < 0) return result;
+
+    if (pid == 0) {
+        // Child; quiet output, then run write_gpt
+        const int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+#ifdef __linux__
+        if (count_syscalls) {
+            ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+            raise(SIGSTOP);
+        }
+#endif
+        execv(write_gpt, argv);
+        _exit(127);
+    }
+
+    int status = 0;
+    struct rusage usage = { 0 };
+#ifdef __linux__
+    if (count_syscalls) {
+        // Stop at every syscall entry & exit of every thread; count entries
+        waitpid(pid, &status, 0);
+        ptrace(PTRACE_SETOPTIONS, pid, NULL,
+               PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+        ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+        result.syscalls = 0;
+        while (true) {
+            const pid_t tid = wait4(-1, &status, __WALL, &usage);
+            if (tid < 0) break;
+            if (WIFEXITED(status) || WIFSIGNALED(status)) {
+                if (tid == pid) break;
+                continue;
+            }
+
+            int signal = 0;
+            if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+                struct ptrace_syscall_info info;
+                if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof info, &info) > 0 &&
+                    info.op == PTRACE_SYSCALL_INFO_ENTRY)
+                    result.syscalls++;
+            } else if (WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP) {
+                signal = WSTOPSIG(status);  // Pass on real signals
+            }
+            ptrace(PTRACE_SYSCALL, tid, NULL, signal);
+        }
+    } else
+#endif
+    {
+        wait4(pid, &status, 0, &usage);
+    }
+
+    result.wall_secs = now() - start;
+    result.max_rss_kb = usage.ru_maxrss;
+    result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    unlink("bench.hdd");
+    return result;
+}
+
+// =====================================
+// Add tiny files to the ESP, all in 1 directory
+// =====================================
+static bool make_tiny_esp(Workload *work, const uint64_t num_files) {
+    FILE *manifest = fopen("tiny.txt", "wb");
+    if (!manifest || mkdir("tiny", 0755) != 0) return false;
+
+    char path[64];
+    for (uint64_t i = 0; i < num_files; i++) {
+        snprintf(path, sizeof path, "tiny/F%"PRIu64".TXT", i);
+        if (!write_file(path, 100, i)) return false;
+        fprintf(manifest, "esp /TINY/ %s\n", path);
+    }
+    fclose(manifest);
+
+    *work = (Workload){ "tiny_esp_files", "tiny.txt", 512, 64, 1, num_files, num_files * 100 };
+    return true;
+}
+
+// =====================================
+// Add files at every level of a deep ESP directory tree
+// =====================================
+static bool make_deep_tree(Workload *work, const uint32_t depth, const uint32_t files_per_dir) {
+    FILE *manifest = fopen("deep.txt", "wb");
+    if (!manifest || mkdir("deep", 0755) != 0) return false;
+
+    char esp_path[512] = "/", path[64];
+    uint64_t num_files = 0;
+    for (uint32_t level = 0; level < depth; level++) {
+        snprintf(esp_path + strlen(esp_path), sizeof esp_path - strlen(esp_path), "D%02"PRIu32"/", level);
+        for (uint32_t i = 0; i < files_per_dir; i++, num_files++) {
+            snprintf(path, sizeof path, "deep/F%"PRIu64".BIN", num_files);
+            if (!write_file(path, 4096, num_files)) return false;
+            fprintf(manifest, "esp %s %s\n", esp_path, path);
+        }
+    }
+    fclose(manifest);
+
+    *work = (Workload){ "deep_esp_tree", "deep.txt", 512, 64, 1, num_files, num_files * 4096 };
+    return true;
+}
+
+// =====================================
+// Add a few big files to the data partition
+// =====================================
+static bool make_big_data(Workload *work, const uint64_t file_mib, const uint32_t num_files) {
+    FILE *manifest = fopen("big.txt", "wb");
+    if (!manifest) return false;
+
+    char path[64];
+    for (uint32_t i = 0; i < num_files; i++) {
+        snprintf(path, sizeof path, "big%"PRIu32".bin", i);
+        if (!write_file(path, file_mib * 1024 * 1024, 1000000 + i)) return false;
+        fprintf(manifest, "data %s\n", path);
+    }
+    fclose(manifest);
+
+    *work = (Workload){ "big_data_files", "big.txt", 512, 64, file_mib * num_files + 16,
+                        num_files, file_mib * num_files * 1024 * 1024 };
+    return true;
+}
+
+// =====================================
+// Mixed ESP & data workload, for each lba size
+// =====================================
+static bool make_mixed(Workload *work) {
+    FILE *manifest = fopen("mixed.txt", "wb");
+    if (!manifest) return false;
+
+    for (uint64_t i = 0; i < 1000; i++)
+        fprintf(manifest, "esp /MIXED/ tiny/F%"PRIu64".TXT\n", i);
+    if (!write_file("mixed.bin", 64 * 1024 * 1024, 2000000)) return false;
+    fprintf(manifest, "data mixed.bin\n");
+    fclose(manifest);
+
+    *work = (Workload){ "mixed_lba_size", "mixed.txt", 512, 0, 80, 1001, 1000 * 100 + 64 * 1024 * 1024 };
+    return true;
+}
+
+// =====================================
+// Add 1 data partition file per workload, doubling in size up to file_mib,
+//   to check throughput stays flat as files grow
+// =====================================
+static bool make_data_scaling(Workload works[3], const uint64_t file_mib) {
+    char path[64], manifest_name[64];
+    for (uint32_t i = 0; i < 3; i++) {
+        const uint64_t mib = (file_mib >> (2 - i)) ? file_mib >> (2 - i) : 1;
+        snprintf(path, sizeof path, "scale%"PRIu32".bin", i);
+        snprintf(manifest_name, sizeof manifest_name, "scale%"PRIu32".txt", i);
+
+        FILE *manifest = fopen(manifest_name, "wb");
+        if (!manifest || !write_file(path, mib * 1024 * 1024, 3000000 + i)) {
+            if (manifest) fclose(manifest);
+            return false;
+        }
+        fprintf(manifest, "data %s\n", path);
+        fclose(manifest);
+
+        works[i] = (Workload){ "data_scaling", strdup(manifest_name), 512, 64, mib + 16,
+                               1, mib * 1024 * 1024 };
+    }
+    return true;
+}
+
+// =====================================
+// Same ESP files in ESPs growing 8x per workload from esp_mib, to check that FAT
+//   size doesn't slow down adding files
+// =====================================
+static bool make_esp_scaling(Workload works[3], const uint32_t esp_mib) {
+    FILE *manifest = fopen("espscale.txt", "wb");
+    if (!manifest) return false;
+
+    for (uint64_t i = 0; i < 1000; i++)
+        fprintf(manifest, "esp /SCALE/ tiny/F%"PRIu64".TXT\n", i);
+    fprintf(manifest, "esp /SCALE/ mixed.bin\n");
+    fclose(manifest);
+
+    for (uint32_t i = 0; i < 3; i++)
+        works[i] = (Workload){ "esp_scaling", "espscale.txt", 512, esp_mib << (3 * i), 1, 1001, 
+                               1000 * 100 + 64 * 1024 * 1024 };
+    return true;
+}
+
+// =====================================
+// Print 1 workload's results as a JSON line
+// =====================================
+static void print_result(const Workload *work, const Run_Result *timed, const Run_Result *counted) {
+    printf("{\"workload\":\"%s\",\"lba_size\":%"PRIu32",\"esp_mib\":%"PRIu32",\"files\":%"PRIu64","
+           "\"bytes\":%"PRIu64",\"wall_s\":%.6f,\"mb_s\":%.1f,\"syscalls\":%"PRId64",\"max_rss_kb\":%ld,"
+           "\"ok\":%s}\n",
+           work->name, work->lba_size, work->esp_size, work->files, work->bytes,
+           timed->wall_secs, work->bytes / 1e6 / timed->wall_secs, counted->syscalls,
+           timed->max_rss_kb, timed->ok && counted->ok ? "true" : "false");
+    fflush(stdout);
+}
+
+// =============================
+// MAIN
+// =============================
+int main(int argc, char *argv[]) {
+    // --large opts into GiB sized files & ESPs; the defaults keep a run to a few hundred MiB
+    const bool large = argc > 1 && !strcmp(argv[1], "--large");
+    if (large) {
+        argc--;
+        argv++;
+    }
+    const char *write_gpt = argc > 1 ? argv[1] : "./write_gpt";
+    const uint64_t big_mib = argc > 2 ? strtoull(argv[2], NULL, 10) : (large ? 1024 : 64);
+    const uint32_t num_big = argc > 3 ? strtoul(argv[3], NULL, 10) : 2;
+    const uint32_t esp_scaling_mib = large ? 1024 : 128;
+
+    char write_gpt_path[4096];
+    if (!realpath(write_gpt, write_gpt_path) || access(write_gpt_path, X_OK) != 0 || !big_mib) {
+        fprintf(stderr, "usage: %s [--large] [write_gpt path] [big file MiB] [# of big files]\n", 
+                large ? argv[-1] : argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Work in a temporary directory on the same filesystem as the current directory
+    char work_dir[] = "write_gpt_bench.XXXXXX";
+    if (!mkdtemp(work_dir) || chdir(work_dir) != 0) {
+        fprintf(stderr, "Error: Could not create work directory\n");
+        return EXIT_FAILURE;
+    }
+
+    Workload tiny, deep, big, mixed, data_scaling[3] = { 0 }, esp_scaling[3];
+    bool ok = make_tiny_esp(&tiny, 5000) && make_deep_tree(&deep, 32, 8) &&
+              make_big_data(&big, big_mib, num_big) && make_mixed(&mixed) &&
+              make_data_scaling(data_scaling, big_mib) && make_esp_scaling(esp_scaling, esp_scaling_mib);
+    if (!ok) fprintf(stderr, "Error: Could not create workload files in '%s'\n", work_dir);
+
+    Workload *workloads[] = { &tiny, &deep, &big, 
+                              &data_scaling[0], &data_scaling[1], &data_scaling[2],
+                              &esp_scaling[0], &esp_scaling[1], &esp_scaling[2] };
+    for (size_t i = 0; ok && i < sizeof workloads / sizeof workloads[0]; i++) {
+        const Run_Result timed = run_write_gpt(write_gpt_path, workloads[i], false);
+        const Run_Result counted = run_write_gpt(write_gpt_path, workloads[i], true);
+        print_result(workloads[i], &timed, &counted);
+        ok = timed.ok && counted.ok;
+    }
+
+    // Every lba size, with the minimum ESP size for it
+    const uint32_t lba_sizes[] = { 512, 1024, 2048, 4096 };
+    const uint32_t esp_sizes[] = { 33, 65, 129, 257 };
+    for (size_t i = 0; ok && i < sizeof lba_sizes / sizeof lba_sizes[0]; i++) {
+        mixed.lba_size = lba_sizes[i];
+        mixed.esp_size = esp_sizes[i];
+        const Run_Result timed = run_write_gpt(write_gpt_path, &mixed, false);
+        const Run_Result counted = run_write_gpt(write_gpt_path, &mixed, true);
+        print_result(&mixed, &timed, &counted);
+        ok = timed.ok && counted.ok;
+    }
+
+    // Clean up workload files
+    for (uint32_t i = 0; i < 3; i++)
+        free((char *)data_scaling[i].manifest);
+    if (chdir("..") == 0) {
+        char command[64];
+        snprintf(command, sizeof command, "rm -rf %s", work_dir);
+        if (system(command) != 0) fprintf(stderr, "Error: Could not remove '%s'\n", work_dir);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Error: write_gpt failed for a workload\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}